@@ -1,103 +1,192 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <vector>
 
 #include "compressed_vector.h"
 
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+// Bits are stored in cache lines of a header word followed by kLineWords data words.
+// Header: bits [0, kAbsBits) hold the number of ones before the line,
+// then kPairsCount counters of kPairBits bits: ones in the first 2, 4, 6 data words of the line.
+// So Rank reads one cache line: the header and at most two data words.
 class BitVector {
+    friend class BitVectorBuilder;
 public:
-    BitVector() = default;
-
-    void Init(const std::vector<bool>& data) {
-        data_ = data;
-        InitBlocks();
-        InitSelectStats();
+    BitVector() : lines_(), select_samples_(), select0_samples_(), size_(0), ones_count_(0) {
     }
 
-    void PushBack(bool x) {
-        data_.push_back(x);
-    }
+    void Init(const std::vector<bool>& data);
 
     bool operator[](size_t i) const {
-        return data_[i];
+        return (lines_[i / kLineBits].words[i % kLineBits / kWordBits] >> (i % kWordBits)) & 1;
     }
 
-    std::vector<bool>::reference operator[](size_t i) {
-        return data_[i];
+    // Bits [pos, pos + count) packed into an integer, bit pos goes to the lowest bit; count <= 64
+    uint64_t GetBits(size_t pos, size_t count) const {
+        size_t word = pos / kWordBits;
+        size_t offset = pos % kWordBits;
+        uint64_t result = GetWord(word) >> offset;
+        if (offset + count > kWordBits && word + 1 < lines_.size() * kLineWords) {
+            result |= GetWord(word + 1) << (kWordBits - offset);
+        }
+        return count == kWordBits ? result : result & ((static_cast<uint64_t>(1) << count) - 1);
     }
 
+    // Number of stored bits
     size_t Size() const {
-        return data_.size() + aggregates_.BitsSize() + blocks_.BitsSize() + select_stats_.BitsSize();
+        return size_;
     }
 
+    // Memory used, in bits
+    size_t BitsSize() const {
+        return lines_.size() * sizeof(Line) * CHAR_BIT + select_samples_.BitsSize() + select0_samples_.BitsSize();
+    }
+
+    // Number of ones in [0, pos]
     int Rank(int pos) const {
-        size_t large_block_number = pos / aggregate_step_;
-        size_t small_block_number = pos / basic_block_size_;
+        if (pos < 0) {
+            return 0;
+        }
+        if (static_cast<size_t>(pos) >= size_) {
+            return ones_count_;
+        }
+        const Line& line = lines_[pos / kLineBits];
+        size_t bit = pos % kLineBits;
+        size_t word = bit / kWordBits;
+        uint64_t rank = line.header & kAbsMask;
+        if (word >= 2) {
+            rank += (line.header >> (kAbsBits + (word / 2 - 1) * kPairBits)) & kPairMask;
+        }
+        if (word % 2 == 1) {
+            rank += __builtin_popcountll(line.words[word - 1]);
+        }
+        rank += __builtin_popcountll(line.words[word] & (~static_cast<uint64_t>(0) >> (kWordBits - 1 - bit % kWordBits)));
+        return rank;
+    }
 
-        int rank = 0;
-        if (large_block_number > 0) {
-            rank = aggregates_.GetValueByIndex(large_block_number - 1);
+    // Position of the i-th one (1-based), -1 if there is no such one.
+    // The sample gives the range of lines, binary search on the headers finds the line,
+    // pair counters and popcount find the word, and select-in-word finds the bit.
+    int Select(int i) const {
+        if (i <= 0 || static_cast<size_t>(i) > ones_count_) {
+            return -1;
         }
+        return SelectImpl<true>(i, select_samples_);
+    }
 
-        for (size_t i = large_block_number * aggregate_step_ / basic_block_size_; i < small_block_number; ++i) {
-            rank += blocks_.GetValueByIndex(i);
+    // Position of the i-th zero (1-based), -1 if there is no such zero.
+    // Needs zero samples, see BitVectorBuilder.
+    int Select0(int i) const {
+        if (i <= 0 || static_cast<size_t>(i) > size_ - ones_count_ || select0_samples_.Size() == 0) {
+            return -1;
         }
+        return SelectImpl<false>(i, select0_samples_);
+    }
 
-        for (size_t i = small_block_number * basic_block_size_; i <= pos && i < data_.size(); ++i) {
-            if (data_[i]) {
-                ++rank;
-            }
+private:
+    static constexpr size_t kWordBits = 64;
+    static constexpr size_t kLineWords = 7;
+    static constexpr size_t kLineBits = kLineWords * kWordBits;
+    static constexpr size_t kPairsCount = 3;
+    static constexpr size_t kPairBits = 9;
+    static constexpr size_t kAbsBits = kWordBits - kPairsCount * kPairBits;
+    static constexpr uint64_t kAbsMask = (static_cast<uint64_t>(1) << kAbsBits) - 1;
+    static constexpr uint64_t kPairMask = (static_cast<uint64_t>(1) << kPairBits) - 1;
+
+    struct alignas(64) Line {
+        uint64_t header = 0;
+        uint64_t words[kLineWords] = {};
+    };
+
+    uint64_t GetWord(size_t word) const {
+        return lines_[word / kLineWords].words[word % kLineWords];
+    }
+
+    // Position of the one with the given 0-based rank in x
+    static size_t SelectInWord(uint64_t x, size_t rank) {
+#ifdef __BMI2__
+        return __builtin_ctzll(_pdep_u64(static_cast<uint64_t>(1) << rank, x));
+#else
+        // Byte-wise prefix popcounts find the byte, then the lowest ones are dropped inside it
+        const uint64_t kOnesStep8 = 0x0101010101010101ull;
+        uint64_t counts = x - ((x >> 1) & 0x5555555555555555ull);
+        counts = (counts & 0x3333333333333333ull) + ((counts >> 2) & 0x3333333333333333ull);
+        counts = (counts + (counts >> 4)) & 0x0f0f0f0f0f0f0f0full;
+        uint64_t prefix = counts * kOnesStep8;
+        size_t byte = 0;
+        while (((prefix >> (byte * CHAR_BIT)) & 0xff) <= rank) {
+            ++byte;
         }
+        if (byte > 0) {
+            rank -= (prefix >> ((byte - 1) * CHAR_BIT)) & 0xff;
+        }
+        x >>= byte * CHAR_BIT;
+        for (; rank > 0; --rank) {
+            x &= x - 1;
+        }
+        return byte * CHAR_BIT + __builtin_ctzll(x);
+#endif
+    }
 
-        return rank;
+    // Number of ones (or zeros) in the lines before the line and in the first 2 * (k + 1) words of it
+    template <bool kOnes>
+    static size_t CountBefore(const Line& line, size_t line_index) {
+        size_t ones = line.header & kAbsMask;
+        return kOnes ? ones : line_index * kLineBits - ones;
     }
 
-    int Select(int i) const {
-        size_t select_bucket = i / select_step_;
-        int cnt = select_bucket * select_step_;
-        int pos = -1;
-        if (select_bucket > 0) {
-            pos = select_stats_.GetValueByIndex(select_bucket - 1);
-        }
-
-        size_t large_block_number = std::max(pos, 0) / aggregate_step_;
-        while (large_block_number < aggregates_.Size()) {
-            int new_cnt = aggregates_.GetValueByIndex(large_block_number);
-            if (new_cnt < i) {
-                cnt = new_cnt;
-                pos = (large_block_number + 1) * aggregate_step_ - 1;
-                ++large_block_number;
+    template <bool kOnes>
+    static size_t CountInPairs(const Line& line, size_t k) {
+        size_t ones = (line.header >> (kAbsBits + k * kPairBits)) & kPairMask;
+        return kOnes ? ones : 2 * (k + 1) * kWordBits - ones;
+    }
+
+    template <bool kOnes>
+    int SelectImpl(int i, const CompressedVector<uint32_t>& samples) const {
+        size_t sample = (i - 1) / select_step_;
+        size_t left = samples.GetValueByIndex(sample);
+        size_t right = lines_.size() - 1;
+        if (sample + 1 < samples.Size()) {
+            right = samples.GetValueByIndex(sample + 1);
+        }
+        while (left < right) {
+            size_t middle = (left + right + 1) / 2;
+            if (CountBefore<kOnes>(lines_[middle], middle) < static_cast<size_t>(i)) {
+                left = middle;
             } else {
-                break;
+                right = middle - 1;
             }
         }
 
-        while (cnt < i) {
-            // This slows down select
-            /*
-            if (pos + 1 % basic_block_size_ == 0) {
-                int block_ones = blocks_.GetValueByIndex((pos + 1) / basic_block_size_);
-                if (cnt + block_ones < i) {
-                    pos += basic_block_size_;
-                    cnt += block_ones;
-                }
-            }
-            */
-            pos += 1;
-            if (pos >= data_.size()) {
-                return -1;
-            }
-            if (data_[pos]) {
-                cnt += 1;
+        const Line& line = lines_[left];
+        size_t rest = i - CountBefore<kOnes>(line, left);
+        size_t word = 0;
+        size_t before = 0;
+        for (size_t k = 0; k < kPairsCount; ++k) {
+            size_t count = CountInPairs<kOnes>(line, k);
+            if (count >= rest) {
+                break;
             }
+            before = count;
+            word = 2 * (k + 1);
         }
-
-        return pos;
+        uint64_t bits = kOnes ? line.words[word] : ~line.words[word];
+        size_t count = __builtin_popcountll(bits);
+        if (before + count < rest) {
+            before += count;
+            ++word;
+            bits = kOnes ? line.words[word] : ~line.words[word];
+        }
+        return left * kLineBits + word * kWordBits + SelectInWord(bits, rest - before - 1);
     }
 
-private:
-    size_t GetBlockBitsCount(size_t size) const {
+    static size_t GetBlockBitsCount(size_t size) {
         size_t x = std::ceil(std::log2(size));
         while (x % 4 != 0) {
             ++x;
@@ -105,56 +194,182 @@ private:
         return x;
     }
 
-    void InitBlocks() {
-        size_t large_blocks_count = std::ceil(static_cast<double>(data_.size()) / aggregate_step_);
-        size_t small_blocks_count = std::ceil(static_cast<double>(data_.size()) / basic_block_size_);
-        aggregates_ = CompressedVector<uint32_t>(large_blocks_count, GetBlockBitsCount(data_.size()));
-        blocks_ = CompressedVector<uint32_t>(small_blocks_count, GetBlockBitsCount(basic_block_size_ + 1));
+    std::vector<Line> lines_;
+    CompressedVector<uint32_t> select_samples_;
+    CompressedVector<uint32_t> select0_samples_;
+    static constexpr size_t select_step_ = 256;
+    size_t size_;
+    size_t ones_count_;
+};
 
-        size_t ones_count = 0;
-        size_t basic_block_ones_count = 0;
-        for (size_t i = 0; i < data_.size(); ++i) {
-            if (i > 0 && i % aggregate_step_ == 0) {
-                aggregates_.SetValueByIndex(i / aggregate_step_ - 1, ones_count);
-            }
-            if (i > 0 && i % basic_block_size_ == 0) {
-                blocks_.SetValueByIndex(i / basic_block_size_ - 1, basic_block_ones_count);
-                basic_block_ones_count = 0;
-            }
-            if (data_[i]) {
-                ++ones_count;
-                ++basic_block_ones_count;
-            }
+// Appends bits straight into the BitVector lines. The rank directory and the select samples
+// are updated as bits arrive, so Build only packs the samples and moves the lines out.
+// Samples for Select0 are kept only if with_select0 is set.
+class BitVectorBuilder {
+public:
+    explicit BitVectorBuilder(bool with_select0 = false)
+        : bits_(), select_samples_(), select0_samples_(), with_select0_(with_select0) {
+    }
+
+    void Reserve(size_t size) {
+        bits_.lines_.reserve(size / BitVector::kLineBits + 1);
+    }
+
+    void PushBack(bool x) {
+        if (bits_.size_ % BitVector::kLineBits == 0) {
+            bits_.lines_.emplace_back();
+            bits_.lines_.back().header = bits_.ones_count_;
+        }
+        ++bits_.size_;
+        if (x) {
+            AddOne(bits_.size_ - 1);
+        } else {
+            AddZero();
         }
-        aggregates_.SetValueByIndex(large_blocks_count - 1, ones_count);
-        blocks_.SetValueByIndex(small_blocks_count - 1, basic_block_ones_count);
+    }
 
-        ones_count_ = ones_count;
+    // Changes the last pushed bit
+    void SetBack(bool x) {
+        size_t pos = bits_.size_ - 1;
+        if (bits_[pos] == x) {
+            return;
+        }
+        if (x) {
+            RemoveZero();
+            AddOne(pos);
+        } else {
+            RemoveOne(pos);
+            AddZero();
+        }
     }
 
-    void InitSelectStats() {
-        size_t select_blocks_count = std::floor(static_cast<double>(ones_count_) / select_step_);
-        select_stats_ = CompressedVector<uint32_t>(select_blocks_count, GetBlockBitsCount(data_.size()));
+    size_t Size() const {
+        return bits_.size_;
+    }
 
-        int j = -1;
-        size_t bit_count = 0;
-        for (size_t i = 0; i < select_blocks_count; ++i) {
-            while (bit_count < select_step_ * (i + 1)) {
-                ++j;
-                if (data_[j]) {
-                    ++bit_count;
-                }
+    // Pushes the lowest count bits of word, lowest first; count <= 64
+    void PushBits(uint64_t word, size_t count) {
+        while (count > 0) {
+            if (bits_.size_ % BitVector::kLineBits == 0) {
+                bits_.lines_.emplace_back();
+                bits_.lines_.back().header = bits_.ones_count_;
             }
-            select_stats_.SetValueByIndex(i, j);
+            // The part of word that fits into the current data word
+            size_t bit = bits_.size_ % BitVector::kLineBits;
+            size_t offset = bit % BitVector::kWordBits;
+            size_t taken = std::min(count, BitVector::kWordBits - offset);
+            uint64_t part = taken == BitVector::kWordBits ? word : word & ((static_cast<uint64_t>(1) << taken) - 1);
+            AddBits(bit / BitVector::kWordBits, offset, part, taken);
+            word = taken == BitVector::kWordBits ? 0 : word >> taken;
+            count -= taken;
         }
     }
 
-    std::vector<bool> data_;
-    CompressedVector<uint32_t> aggregates_;
-    CompressedVector<uint32_t> blocks_;
-    CompressedVector<uint32_t> select_stats_;
-    const size_t aggregate_step_ = 256;
-    const size_t basic_block_size_ = 32;
-    const size_t select_step_ = 256;
-    size_t ones_count_;
-};
\ No newline at end of file
+    // Copies whole words, shifted into place when Size() is not a multiple of 64
+    void Append(const BitVector& bits) {
+        for (size_t i = 0; i < bits.size_; i += BitVector::kWordBits) {
+            size_t count = std::min(BitVector::kWordBits, bits.size_ - i);
+            PushBits(bits.GetBits(i, count), count);
+        }
+    }
+
+    BitVector Build() {
+        PackSamples(select_samples_, bits_.select_samples_);
+        PackSamples(select0_samples_, bits_.select0_samples_);
+        BitVector result = std::move(bits_);
+        bits_ = BitVector();
+        return result;
+    }
+
+private:
+    // Writes count bits of part at offset in data word word of the last line, the bits above are zeros
+    void AddBits(size_t word, size_t offset, uint64_t part, size_t count) {
+        BitVector::Line& line = bits_.lines_.back();
+        line.words[word] |= part << offset;
+        size_t ones = __builtin_popcountll(part);
+        for (size_t k = word / 2; k < BitVector::kPairsCount; ++k) {
+            line.header += static_cast<uint64_t>(ones) << (BitVector::kAbsBits + k * BitVector::kPairBits);
+        }
+        size_t zeros = count - ones;
+        size_t zeros_count = bits_.size_ - bits_.ones_count_;
+        AddSamples(select_samples_, bits_.ones_count_, ones);
+        if (with_select0_) {
+            AddSamples(select0_samples_, zeros_count, zeros);
+        }
+        bits_.size_ += count;
+        bits_.ones_count_ += ones;
+    }
+
+    // Samples for the ones (or zeros) with 0-based numbers from first to first + count - 1, all in the last line
+    void AddSamples(std::vector<uint32_t>& samples, size_t first, size_t count) {
+        size_t next = (first + BitVector::select_step_ - 1) / BitVector::select_step_ * BitVector::select_step_;
+        for (; next < first + count; next += BitVector::select_step_) {
+            samples.push_back(bits_.lines_.size() - 1);
+        }
+    }
+
+    void AddOne(size_t pos) {
+        BitVector::Line& line = bits_.lines_.back();
+        size_t bit = pos % BitVector::kLineBits;
+        size_t word = bit / BitVector::kWordBits;
+        line.words[word] |= static_cast<uint64_t>(1) << (bit % BitVector::kWordBits);
+        for (size_t k = word / 2; k < BitVector::kPairsCount; ++k) {
+            line.header += static_cast<uint64_t>(1) << (BitVector::kAbsBits + k * BitVector::kPairBits);
+        }
+        // Sample k is the line of the (k * select_step_ + 1)-th one
+        if (bits_.ones_count_ % BitVector::select_step_ == 0) {
+            select_samples_.push_back(bits_.lines_.size() - 1);
+        }
+        ++bits_.ones_count_;
+    }
+
+    void RemoveOne(size_t pos) {
+        BitVector::Line& line = bits_.lines_.back();
+        size_t bit = pos % BitVector::kLineBits;
+        size_t word = bit / BitVector::kWordBits;
+        line.words[word] &= ~(static_cast<uint64_t>(1) << (bit % BitVector::kWordBits));
+        for (size_t k = word / 2; k < BitVector::kPairsCount; ++k) {
+            line.header -= static_cast<uint64_t>(1) << (BitVector::kAbsBits + k * BitVector::kPairBits);
+        }
+        --bits_.ones_count_;
+        if (bits_.ones_count_ % BitVector::select_step_ == 0) {
+            select_samples_.pop_back();
+        }
+    }
+
+    // The zero is already counted in size_
+    void AddZero() {
+        size_t zeros_count = bits_.size_ - bits_.ones_count_;
+        if (with_select0_ && (zeros_count - 1) % BitVector::select_step_ == 0) {
+            select0_samples_.push_back(bits_.lines_.size() - 1);
+        }
+    }
+
+    void RemoveZero() {
+        size_t zeros_count = bits_.size_ - bits_.ones_count_;
+        if (with_select0_ && (zeros_count - 1) % BitVector::select_step_ == 0) {
+            select0_samples_.pop_back();
+        }
+    }
+
+    void PackSamples(std::vector<uint32_t>& samples, CompressedVector<uint32_t>& result) {
+        result = CompressedVector<uint32_t>(
+            samples.size(), BitVector::GetBlockBitsCount(std::max<size_t>(bits_.lines_.size(), 2)));
+        result.Set(0, samples.data(), samples.size());
+        samples.clear();
+    }
+
+    BitVector bits_;
+    std::vector<uint32_t> select_samples_;
+    std::vector<uint32_t> select0_samples_;
+    bool with_select0_;
+};
+
+inline void BitVector::Init(const std::vector<bool>& data) {
+    BitVectorBuilder builder;
+    builder.Reserve(data.size());
+    for (size_t i = 0; i < data.size(); ++i) {
+        builder.PushBack(data[i]);
+    }
+    *this = builder.Build();
+}
@@ -1,3 +1,7 @@
+#pragma once
+
+#include <vector>
+
 #include "filter.h"
 #include "hash.h"
 
@@ -1,44 +1,137 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
 // index = bucket_size_ * hash + bucket
 
-template <class Int = uint32_t>
+// count copies of pattern placed every step bits
+constexpr uint64_t RepeatBits(uint64_t pattern, size_t step, size_t count) {
+    uint64_t result = 0;
+    for (size_t i = 0; i < count; ++i) {
+        result |= pattern << (i * step);
+    }
+    return result;
+}
+
+// Items are packed little-endian into 64-bit words followed by one padding word, so an item of up to
+// kMaxLoadBits bits is read with a single unaligned 64-bit load, a shift and a mask, without branches.
+// Wider items (only for Int = uint64_t) are read from two aligned words.
+// The item size is Bits, known at compile time, or chosen at runtime if Bits = 0.
+template <class Int = uint32_t, size_t Bits = 0>
 class CompressedVector {
+    static_assert(Bits <= sizeof(Int) * CHAR_BIT, "Item must fit into Int");
 public:
     CompressedVector() = default;
 
+    explicit CompressedVector(size_t vector_size) : CompressedVector(vector_size, Bits) {
+        static_assert(Bits > 0, "Item size must be given at runtime");
+    }
+
     CompressedVector(size_t vector_size, size_t item_size)
-        : data_(), vector_size_(vector_size), item_size_(item_size), int_size_(sizeof(Int) * CHAR_BIT) {
-        assert(item_size <= int_size_);
-        data_.resize((item_size_ * vector_size / int_size_) + 1);
-    };
+        : data_((item_size * vector_size + kWordBits - 1) / kWordBits + 1),
+          vector_size_(vector_size),
+          item_size_(item_size),
+          mask_(LowBitsMask(item_size)) {
+        assert(item_size <= kLaneBits && (Bits == 0 || item_size == Bits));
+    }
 
     Int GetValueByIndex(size_t index) const {
-        size_t start_pos = (item_size_ * index) / int_size_;
-        size_t start_offset = (item_size_ * index) % int_size_;
-        Int value = 0;
-        if (start_offset + item_size_ <= int_size_) {
-            value = GetBitsFromInt(data_[start_pos], start_offset, start_offset + item_size_);
-        } else {
-            size_t end_offset = start_offset + item_size_ - int_size_;
-            value = GetBitsFromInt(data_[start_pos], start_offset, int_size_) << end_offset;
-            value |= GetBitsFromInt(data_[start_pos + 1], 0, end_offset);
+        size_t start_bit = ItemSize() * index;
+        if (FitsLoad()) {
+            return static_cast<Int>((Load(start_bit / CHAR_BIT) >> (start_bit % CHAR_BIT)) & Mask());
         }
-        return value;
+        return static_cast<Int>(LoadBits(start_bit) & Mask());
     }
 
     void SetValueByIndex(size_t index, Int value) {
-        size_t start_pos = (item_size_ * index) / int_size_;
-        size_t start_offset = (item_size_ * index) % int_size_;
-        if (start_offset + item_size_ <= int_size_) {
-            SetBitsToInt(data_[start_pos], value, start_offset, start_offset + item_size_);
-        } else {
-            size_t end_offset = start_offset + item_size_ - int_size_;
-            SetBitsToInt(data_[start_pos], value >> end_offset, start_offset, int_size_);
-            SetBitsToInt(data_[start_pos + 1], value & ((1ul << end_offset) - 1), 0, end_offset);
+        size_t start_bit = ItemSize() * index;
+        uint64_t item = static_cast<uint64_t>(value) & Mask();
+        if (FitsLoad()) {
+            size_t shift = start_bit % CHAR_BIT;
+            uint64_t word = Load(start_bit / CHAR_BIT);
+            word = (word & ~(Mask() << shift)) | (item << shift);
+            Store(start_bit / CHAR_BIT, word);
+            return;
+        }
+        StoreBits(start_bit, item, Mask());
+    }
+
+    // Atomic mode for concurrent writers. Every word is changed with a CAS loop,
+    // so concurrent writes to neighbouring items sharing a word don't overwrite each other.
+    // An item straddling two words can't be changed by a single CAS: its atomic operations
+    // take a spinlock (striped by word address and shared by all vectors) and then update
+    // both words with CAS loops, so they are atomic with respect to other atomic operations
+    // on the same item. Atomic and plain SetValueByIndex (or Set) calls must not be mixed concurrently.
+    Int AtomicGetValueByIndex(size_t index) const {
+        size_t word = (ItemSize() * index) / kWordBits;
+        size_t offset = (ItemSize() * index) % kWordBits;
+        if (offset + ItemSize() <= kWordBits) {
+            return static_cast<Int>((__atomic_load_n(&data_[word], __ATOMIC_ACQUIRE) >> offset) & Mask());
+        }
+        StraddleLockGuard guard(&data_[word]);
+        return static_cast<Int>(LoadStraddled(word, offset));
+    }
+
+    void AtomicSetValueByIndex(size_t index, Int value) {
+        AtomicUpdate(index, 0, value, false);
+    }
+
+    // Sets the item to desired if it is equal to expected, returns false otherwise
+    bool AtomicCompareAndSwap(size_t index, Int expected, Int desired) {
+        return AtomicUpdate(index, expected, desired, true);
+    }
+
+    // Bulk access: items are moved in groups filling a 64-bit word, spread to or gathered from
+    // the narrowest lanes holding an item (8 items of up to 8 bits, 4 of up to 16 bits...)
+    // by pdep/pext with BMI2, and widened to or narrowed from Int
+    void Get(size_t first, size_t count, Int* out) const {
+        switch (LaneBits()) {
+            case CHAR_BIT:
+                GetGroups<uint8_t>(first, count, out);
+                break;
+            case 2 * CHAR_BIT:
+                GetGroups<uint16_t>(first, count, out);
+                break;
+            case 4 * CHAR_BIT:
+                GetGroups<uint32_t>(first, count, out);
+                break;
+            default:
+                GetGroups<uint64_t>(first, count, out);
+        }
+    }
+
+    void Set(size_t first, const Int* in, size_t count) {
+        switch (LaneBits()) {
+            case CHAR_BIT:
+                SetGroups<uint8_t>(first, in, count);
+                break;
+            case 2 * CHAR_BIT:
+                SetGroups<uint16_t>(first, in, count);
+                break;
+            case 4 * CHAR_BIT:
+                SetGroups<uint32_t>(first, in, count);
+                break;
+            default:
+                SetGroups<uint64_t>(first, in, count);
+        }
+    }
+
+    void Fill(Int value) {
+        const size_t chunk_size = 64;
+        Int chunk[chunk_size];
+        std::fill(chunk, chunk + chunk_size, value);
+        for (size_t i = 0; i < vector_size_; i += chunk_size) {
+            Set(i, chunk, std::min(chunk_size, vector_size_ - i));
         }
     }
 
@@ -47,22 +140,195 @@ public:
     }
 
     size_t BitsSize() const {
-        return data_.size() * int_size_;
+        return data_.size() * kWordBits;
     }
 
 private:
-    Int GetBitsFromInt(Int x, size_t start, size_t end) const {
-        return (x >> (int_size_ - end)) & ((1ul << (end - start)) - 1);
+    size_t ItemSize() const {
+        return Bits > 0 ? Bits : item_size_;
+    }
+
+    uint64_t Mask() const {
+        return Bits > 0 ? LowBitsMask(Bits) : mask_;
+    }
+
+    // Known at compile time unless the item size is chosen at runtime and Int = uint64_t
+    bool FitsLoad() const {
+        return kLaneBits <= kMaxLoadBits || ItemSize() <= kMaxLoadBits;
+    }
+
+    // The narrowest of 8, 16, 32 and 64 bits holding an item
+    size_t LaneBits() const {
+        size_t lane_bits = CHAR_BIT;
+        while (lane_bits < ItemSize()) {
+            lane_bits *= 2;
+        }
+        return lane_bits;
+    }
+
+    template <class Lane>
+    void GetGroups(size_t first, size_t count, Int* out) const {
+        const size_t group_size = sizeof(uint64_t) / sizeof(Lane);
+        const uint64_t lanes_mask = RepeatBits(Mask(), sizeof(Lane) * CHAR_BIT, group_size);
+        size_t i = 0;
+        for (; i + group_size <= count; i += group_size) {
+            uint64_t lanes = SpreadLanes<Lane>(LoadBits(ItemSize() * (first + i)), lanes_mask);
+            Lane group[group_size];
+            std::memcpy(group, &lanes, sizeof(lanes));
+            for (size_t j = 0; j < group_size; ++j) {
+                out[i + j] = static_cast<Int>(group[j]);
+            }
+        }
+        for (; i < count; ++i) {
+            out[i] = GetValueByIndex(first + i);
+        }
+    }
+
+    template <class Lane>
+    void SetGroups(size_t first, const Int* in, size_t count) {
+        const size_t group_size = sizeof(uint64_t) / sizeof(Lane);
+        const uint64_t lanes_mask = RepeatBits(Mask(), sizeof(Lane) * CHAR_BIT, group_size);
+        const uint64_t group_mask = LowBitsMask(group_size * ItemSize());
+        size_t i = 0;
+        for (; i + group_size <= count; i += group_size) {
+            Lane group[group_size];
+            for (size_t j = 0; j < group_size; ++j) {
+                group[j] = static_cast<Lane>(in[i + j]);
+            }
+            uint64_t lanes;
+            std::memcpy(&lanes, group, sizeof(lanes));
+            StoreBits(ItemSize() * (first + i), GatherLanes<Lane>(lanes, lanes_mask), group_mask);
+        }
+        for (; i < count; ++i) {
+            SetValueByIndex(first + i, in[i]);
+        }
+    }
+
+    // Spreads packed items to the lanes of a word
+    template <class Lane>
+    uint64_t SpreadLanes(uint64_t packed, [[maybe_unused]] uint64_t lanes_mask) const {
+#ifdef __BMI2__
+        return _pdep_u64(packed, lanes_mask);
+#else
+        uint64_t lanes = 0;
+        for (size_t j = 0; j < sizeof(uint64_t) / sizeof(Lane); ++j) {
+            lanes |= ((packed >> (j * ItemSize())) & Mask()) << (j * sizeof(Lane) * CHAR_BIT);
+        }
+        return lanes;
+#endif
+    }
+
+    // Packs items from the lanes of a word
+    template <class Lane>
+    uint64_t GatherLanes(uint64_t lanes, [[maybe_unused]] uint64_t lanes_mask) const {
+#ifdef __BMI2__
+        return _pext_u64(lanes, lanes_mask);
+#else
+        uint64_t packed = 0;
+        for (size_t j = 0; j < sizeof(uint64_t) / sizeof(Lane); ++j) {
+            packed |= ((lanes >> (j * sizeof(Lane) * CHAR_BIT)) & Mask()) << (j * ItemSize());
+        }
+        return packed;
+#endif
     }
 
-    void SetBitsToInt(Int& x, Int value, size_t start, size_t end) {
-        Int mask = ((1ul << int_size_) - 1) ^ (((1ul << (end - start)) - 1) << (int_size_ - end));
-        x &= mask;
-        x |= value << (int_size_ - end);
+    uint64_t Load(size_t byte) const {
+        uint64_t word;
+        std::memcpy(&word, reinterpret_cast<const char*>(data_.data()) + byte, sizeof(word));
+        return word;
     }
 
-    std::vector <Int> data_;
-    size_t vector_size_;
-    size_t item_size_;
-    size_t int_size_;
-};
\ No newline at end of file
+    void Store(size_t byte, uint64_t word) {
+        std::memcpy(reinterpret_cast<char*>(data_.data()) + byte, &word, sizeof(word));
+    }
+
+    // 64 bits starting at start_bit, taken from the two aligned words containing them
+    uint64_t LoadBits(size_t start_bit) const {
+        size_t word = start_bit / kWordBits;
+        size_t offset = start_bit % kWordBits;
+        return (data_[word] >> offset) | (data_[word + 1] << 1 << (kWordBits - 1 - offset));
+    }
+
+    // Replaces the bits mask << start_bit by value, the next word is written even if they don't reach it
+    void StoreBits(size_t start_bit, uint64_t value, uint64_t mask) {
+        size_t word = start_bit / kWordBits;
+        size_t offset = start_bit % kWordBits;
+        size_t rest = kWordBits - 1 - offset;
+        data_[word] = (data_[word] & ~(mask << offset)) | (value << offset);
+        data_[word + 1] = (data_[word + 1] & ~(mask >> 1 >> rest)) | (value >> 1 >> rest);
+    }
+
+    // Item starting at offset of word and ending in the next word, read atomically word by word
+    uint64_t LoadStraddled(size_t word, size_t offset) const {
+        uint64_t value = __atomic_load_n(&data_[word], __ATOMIC_ACQUIRE) >> offset;
+        value |= __atomic_load_n(&data_[word + 1], __ATOMIC_ACQUIRE) << (kWordBits - offset);
+        return value & Mask();
+    }
+
+    class StraddleLockGuard {
+    public:
+        explicit StraddleLockGuard(const void* address)
+            : lock_(locks_[reinterpret_cast<uintptr_t>(address) / sizeof(uint64_t) % kLocksCount]) {
+            while (lock_.exchange(true, std::memory_order_acquire)) {
+            }
+        }
+
+        ~StraddleLockGuard() {
+            lock_.store(false, std::memory_order_release);
+        }
+
+    private:
+        static const size_t kLocksCount = 1024;
+        static std::atomic<bool> locks_[kLocksCount];
+        std::atomic<bool>& lock_;
+    };
+
+    bool AtomicUpdate(size_t index, Int expected, Int value, bool compare) {
+        size_t word = (ItemSize() * index) / kWordBits;
+        size_t offset = (ItemSize() * index) % kWordBits;
+        uint64_t item = static_cast<uint64_t>(value) & Mask();
+        if (offset + ItemSize() <= kWordBits) {
+            return AtomicSetBits(data_[word], static_cast<uint64_t>(expected) & Mask(), item, Mask(), offset, compare);
+        }
+
+        StraddleLockGuard guard(&data_[word]);
+        if (compare && LoadStraddled(word, offset) != (static_cast<uint64_t>(expected) & Mask())) {
+            return false;
+        }
+        size_t rest = kWordBits - offset;
+        AtomicSetBits(data_[word], 0, item & LowBitsMask(rest), LowBitsMask(rest), offset, false);
+        AtomicSetBits(data_[word + 1], 0, item >> rest, Mask() >> rest, 0, false);
+        return true;
+    }
+
+    // Sets the bits mask << shift of x to value, if compare is set only when they are equal to expected
+    static bool AtomicSetBits(uint64_t& x, uint64_t expected, uint64_t value, uint64_t mask, size_t shift, bool compare) {
+        uint64_t old_x = __atomic_load_n(&x, __ATOMIC_RELAXED);
+        while (true) {
+            if (compare && ((old_x >> shift) & mask) != expected) {
+                return false;
+            }
+            uint64_t new_x = (old_x & ~(mask << shift)) | (value << shift);
+            if (__atomic_compare_exchange_n(&x, &old_x, new_x, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                return true;
+            }
+        }
+    }
+
+    static constexpr uint64_t LowBitsMask(size_t bits) {
+        return bits == 0 ? 0 : ~static_cast<uint64_t>(0) >> (kWordBits - bits);
+    }
+
+    static constexpr size_t kWordBits = sizeof(uint64_t) * CHAR_BIT;
+    static constexpr size_t kLaneBits = sizeof(Int) * CHAR_BIT;
+    // Bits left in an unaligned 64-bit load after the in-byte shift
+    static constexpr size_t kMaxLoadBits = kWordBits - (CHAR_BIT - 1);
+
+    std::vector<uint64_t> data_;
+    size_t vector_size_ = 0;
+    size_t item_size_ = 0;
+    uint64_t mask_ = 0;
+};
+
+template <class Int, size_t Bits>
+std::atomic<bool> CompressedVector<Int, Bits>::StraddleLockGuard::locks_[CompressedVector<Int, Bits>::StraddleLockGuard::kLocksCount];
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "compressed_vector.h"
+
+const size_t kVectorSize = 1000;
+const size_t kBulkRounds = 200;
+const size_t kAtomicThreads = 4;
+const size_t kAtomicRounds = 100;
+
+uint64_t ItemMask(size_t item_size) {
+    return item_size == 0 ? 0 : ~static_cast<uint64_t>(0) >> (sizeof(uint64_t) * CHAR_BIT - item_size);
+}
+
+// Bulk Get and Set of random ranges must agree with GetValueByIndex and SetValueByIndex
+template <class Int, size_t Bits = 0>
+void CheckBulk(size_t item_size, std::mt19937& generator) {
+    CompressedVector<Int, Bits> vector(kVectorSize, item_size);
+    std::vector<Int> expected(kVectorSize, 0);
+    std::uniform_int_distribution<uint64_t> values;
+    std::uniform_int_distribution<size_t> positions(0, kVectorSize);
+    std::vector<Int> buffer(kVectorSize);
+    for (size_t round = 0; round < kBulkRounds; ++round) {
+        size_t first = positions(generator);
+        size_t count = std::uniform_int_distribution<size_t>(0, kVectorSize - first)(generator);
+        if (round % 2 == 0) {
+            for (size_t i = 0; i < count; ++i) {
+                buffer[i] = static_cast<Int>(values(generator));
+                expected[first + i] = static_cast<Int>(buffer[i] & ItemMask(item_size));
+            }
+            vector.Set(first, buffer.data(), count);
+        } else {
+            for (size_t i = first; i < first + count; ++i) {
+                expected[i] = static_cast<Int>(values(generator) & ItemMask(item_size));
+                vector.SetValueByIndex(i, expected[i]);
+            }
+        }
+
+        first = positions(generator);
+        count = std::uniform_int_distribution<size_t>(0, kVectorSize - first)(generator);
+        vector.Get(first, count, buffer.data());
+        for (size_t i = 0; i < count; ++i) {
+            if (buffer[i] != expected[first + i] || vector.GetValueByIndex(first + i) != expected[first + i]) {
+                std::cerr << "Bulk access mismatch for " << item_size << "-bit items at " << first + i << "\n";
+                throw "Bulk access mismatch";
+            }
+        }
+    }
+}
+
+void RunBulkTest() {
+    std::cerr << "Bulk Get/Set test\n";
+    std::mt19937 generator(29);
+    for (size_t item_size = 1; item_size <= 8; ++item_size) {
+        CheckBulk<uint8_t>(item_size, generator);
+    }
+    for (size_t item_size = 1; item_size <= 32; ++item_size) {
+        CheckBulk<uint32_t>(item_size, generator);
+    }
+    for (size_t item_size = 1; item_size <= 64; ++item_size) {
+        CheckBulk<uint64_t>(item_size, generator);
+    }
+    CheckBulk<uint8_t, 8>(8, generator);
+    CheckBulk<uint16_t, 12>(12, generator);
+    CheckBulk<uint32_t, 5>(5, generator);
+    CheckBulk<uint32_t, 17>(17, generator);
+    CheckBulk<uint64_t, 41>(41, generator);
+    CheckBulk<uint64_t, 64>(64, generator);
+    std::cerr << "OK\n\n";
+}
+
+// Item i is first set by thread i % kAtomicThreads, so neighbouring items sharing a word, or straddling
+// two words, are written by different threads. Then every thread increases every item kAtomicRounds times
+// with compare-and-swap, so the final values are exact only if no update is lost
+template <class Int, size_t Bits = 0>
+void CheckAtomic(size_t item_size) {
+    CompressedVector<Int, Bits> vector(kVectorSize, item_size);
+    uint64_t mask = ItemMask(item_size);
+    auto start_value = [mask](size_t i) {return static_cast<Int>((i * 0x9E3779B97F4A7C15) & mask);};
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kAtomicThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = t; i < kVectorSize; i += kAtomicThreads) {
+                vector.AtomicSetValueByIndex(i, start_value(i));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    for (size_t t = 0; t < kAtomicThreads; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t round = 0; round < kAtomicRounds; ++round) {
+                for (size_t i = 0; i < kVectorSize; ++i) {
+                    Int value = vector.AtomicGetValueByIndex(i);
+                    while (!vector.AtomicCompareAndSwap(i, value, static_cast<Int>((value + 1) & mask))) {
+                        value = vector.AtomicGetValueByIndex(i);
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (size_t i = 0; i < kVectorSize; ++i) {
+        Int expected = static_cast<Int>((start_value(i) + kAtomicThreads * kAtomicRounds) & mask);
+        if (vector.GetValueByIndex(i) != expected || vector.AtomicGetValueByIndex(i) != expected) {
+            std::cerr << "Atomic update lost for " << item_size << "-bit items at " << i << "\n";
+            throw "Atomic update lost";
+        }
+    }
+}
+
+void RunAtomicTest() {
+    std::cerr << "Atomic writes test\n";
+    CheckAtomic<uint8_t>(3);
+    CheckAtomic<uint32_t>(7);
+    CheckAtomic<uint32_t>(13);
+    CheckAtomic<uint32_t>(29);
+    CheckAtomic<uint32_t>(32);
+    CheckAtomic<uint64_t>(61);
+    CheckAtomic<uint32_t, 5>(5);
+    CheckAtomic<uint64_t, 37>(37);
+    std::cerr << "OK\n\n";
+}
+
+int main() {
+    RunBulkTest();
+    RunAtomicTest();
+}
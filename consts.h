@@ -1,5 +1,9 @@
 #pragma once
 
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+
 const size_t kDefaultNumbersCount = 1000000; // numbers to put into filter
 
 // Bloom filter consts
@@ -18,15 +22,44 @@ const size_t kDefaultAlternateRangeLength = 128;
 // Xor filter consts
 const double kDefaultBucketsCountCoefficient = 1.23;
 const size_t kDefaultAdditionalBuckets = 32;
+const size_t kRetrievalValueBits = 8; // values stored by the xor_retrieval test
+const char kXorKeyFileName[] = "xor_keys.tmp"; // key file of the xor_file test
+const size_t kDefaultXorFileRunRecords = 1 << 20; // key slots sorted in memory at once by BuildFromFile
 
 // SuRF consts
 const size_t kDefaultSurfSuffixSize = 8;
 const char kTerminator = '\0';
 const char kAnyChar = -128;
-const size_t kMaxRealSuffixSize = CHAR_BIT;
+const size_t kMaxHashSuffixSize = 32;
+// Top trie levels are stored in LOUDS-Dense while they are this many times smaller than the rest
+const size_t kSurfSparseDenseRatio = 64;
 
+const double kDefaultSurfBitsPerKey = 16.0; // budget of the auto suffix type
+const size_t kDefaultSurfBuildThreads = 1;
 const int kDefaultFixedLengthValue = 0;
 const double kDefaultCutGainThreshold = 0.0;
+// Number of neighbouring keys cut together by the branch cutting
+const size_t kDefaultCutWindow = 20;
+
+// HOPE key compression consts
+const size_t kDefaultHopeDictionarySize = 1024; // max intervals
+const size_t kDefaultHopeSampleSize = 2000; // keys sampled to choose the n-grams
+const size_t kHopeMaxGramLength = 4;
+const size_t kHopeMinGrams = 32; // n-grams of the smallest dictionary with n-grams tried
+const size_t kHopeMaxCodeBits = 32;
+
+// Grafite filter consts
+const uint64_t kDefaultGrafiteMaxRangeLength = 1 << 17;
+const double kDefaultGrafiteFalsePositiveRate = 0.01;
+
+// Rosetta filter consts
+// Covers the ranges of RunRangeTest: up to 9 gaps between generated numbers, about 7200 for 1000000 uniform
+// numbers and 36000 for 200000
+const uint64_t kDefaultRosettaMaxRangeLength = 1 << 17;
+const double kDefaultRosettaBitsPerKey = 16.0;
+const size_t kRosettaMaxStepBits = 8;
+// Empty ranges the split of memory between levels is optimised for
+const size_t kRosettaSampleRanges = 256;
 
 const int kMinNumber = -2000000000;
 const int kMaxNumber = 2000000000;
@@ -90,9 +90,7 @@ protected:
         // Allocate (fingerprint_size_bits * buckets_count) bits for hash table
         hash_table_ = CompressedVector<HashTableInt>(buckets_count_ * bucket_size_, fingerprint_size_bits_);
         // use value (1 << fingerprint_size_bits_) - 1 as empty indicator
-        for (size_t i = 0; i < hash_table_.Size(); ++i) {
-            hash_table_.SetValueByIndex(i, max_fingerprint_);
-        }
+        hash_table_.Fill(max_fingerprint_);
 
         for (size_t i = 0; i < hash_functions_count_; ++i) {
             hash_functions_.emplace_back(hash_function_builder_(generator_));
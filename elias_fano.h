@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "bitvector.h"
+#include "compressed_vector.h"
+
+// Non-decreasing sequence of values from [0, universe).
+// The low low_bits_ bits of every value are stored in a CompressedVector,
+// the high bits in unary: the i-th value sets bit (value >> low_bits_) + i of high_bits_,
+// and bucket h ends with the h-th zero.
+class EliasFano {
+public:
+    EliasFano() : high_bits_(), low_bits_values_(), low_bits_(0), size_(0) {
+    }
+
+    // values must be sorted
+    void Build(const std::vector<uint64_t>& values, uint64_t universe) {
+        size_ = values.size();
+        low_bits_ = 0;
+        if (size_ > 0 && universe / size_ > 1) {
+            low_bits_ = std::floor(std::log2(static_cast<double>(universe / size_)));
+        }
+
+        if (low_bits_ > 0) {
+            low_bits_values_ = CompressedVector<uint64_t>(size_, low_bits_);
+        }
+        BitVectorBuilder builder(true);
+        if (size_ > 0) {
+            builder.Reserve(size_ + (values.back() >> low_bits_));
+        }
+        uint64_t bucket = 0;
+        for (size_t i = 0; i < size_; ++i) {
+            for (; bucket < (values[i] >> low_bits_); ++bucket) {
+                builder.PushBack(false);
+            }
+            builder.PushBack(true);
+            if (low_bits_ > 0) {
+                low_bits_values_.SetValueByIndex(i, values[i] & LowMask());
+            }
+        }
+        high_bits_ = builder.Build();
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    uint64_t Get(size_t i) const {
+        uint64_t high = high_bits_.Select(i + 1) - i;
+        return (high << low_bits_) | GetLowBits(i);
+    }
+
+    // Index of the first value not less than x, Size() if there is no such value
+    size_t LowerBound(uint64_t x) const {
+        size_t index = 0;
+        uint64_t value = 0;
+        Seek(x, index, value);
+        return index;
+    }
+
+    // Puts the smallest value not less than x to result, returns false if there is no such value
+    bool Successor(uint64_t x, uint64_t& result) const {
+        size_t index = 0;
+        return Seek(x, index, result);
+    }
+
+    size_t BitsSize() const {
+        return high_bits_.BitsSize() + low_bits_values_.BitsSize();
+    }
+
+private:
+    // Select0 finds the bounds of the bucket of x, its values are binary searched by the low bits,
+    // and the first value after the bucket (found by Select) is the answer
+    bool Seek(uint64_t x, size_t& index, uint64_t& value) const {
+        uint64_t bucket = x >> low_bits_;
+        size_t zeros_count = high_bits_.Size() - size_;
+        index = size_;
+        if (bucket > zeros_count) {
+            return false;
+        }
+        size_t left = bucket == 0 ? 0 : high_bits_.Select0(bucket) + 1 - bucket;
+        size_t right = bucket == zeros_count ? size_ : high_bits_.Select0(bucket + 1) - bucket;
+        uint64_t low = x & LowMask();
+        while (left < right) {
+            size_t middle = (left + right) / 2;
+            if (GetLowBits(middle) < low) {
+                left = middle + 1;
+            } else {
+                right = middle;
+            }
+        }
+        if (left == size_) {
+            return false;
+        }
+        index = left;
+        value = Get(left);
+        return true;
+    }
+
+    uint64_t LowMask() const {
+        return (static_cast<uint64_t>(1) << low_bits_) - 1;
+    }
+
+    uint64_t GetLowBits(size_t i) const {
+        return low_bits_ > 0 ? low_bits_values_.GetValueByIndex(i) : 0;
+    }
+
+    BitVector high_bits_;
+    CompressedVector<uint64_t> low_bits_values_;
+    size_t low_bits_;
+    size_t size_;
+};
@@ -0,0 +1,345 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class KeyFileFormat {
+    Lines = 0,          // one key per line
+    LengthPrefixed = 1  // uint32_t little-endian length followed by the key bytes
+};
+
+// Streams keys from a file, the keys are never stored all together
+class KeyFileReader {
+public:
+    KeyFileReader(const std::string& filename, KeyFileFormat format)
+        : in_(filename, std::ios::binary), format_(format) {
+        if (!in_.is_open()) {
+            throw "Can't open key file";
+        }
+    }
+
+    bool Next(std::string& key) {
+        if (format_ == KeyFileFormat::Lines) {
+            return static_cast<bool>(std::getline(in_, key));
+        }
+        unsigned char length_bytes[sizeof(uint32_t)];
+        if (!in_.read(reinterpret_cast<char*>(length_bytes), sizeof(length_bytes))) {
+            return false;
+        }
+        uint32_t length = 0;
+        for (size_t i = 0; i < sizeof(length_bytes); ++i) {
+            length |= static_cast<uint32_t>(length_bytes[i]) << (i * CHAR_BIT);
+        }
+        key.resize(length);
+        if (!in_.read(&key[0], length)) {
+            throw "Unexpected end of key file";
+        }
+        return true;
+    }
+
+    void Rewind() {
+        in_.clear();
+        in_.seekg(0);
+    }
+
+    size_t Count() {
+        Rewind();
+        size_t count = 0;
+        std::string key;
+        while (Next(key)) {
+            ++count;
+        }
+        Rewind();
+        return count;
+    }
+
+private:
+    std::ifstream in_;
+    KeyFileFormat format_;
+};
+
+// Writes keys in the format KeyFileReader reads
+class KeyFileWriter {
+public:
+    KeyFileWriter(const std::string& filename, KeyFileFormat format)
+        : out_(filename, std::ios::binary), format_(format) {
+        if (!out_.is_open()) {
+            throw "Can't create key file";
+        }
+    }
+
+    void Write(const std::string& key) {
+        if (format_ == KeyFileFormat::Lines) {
+            out_ << key << "\n";
+            return;
+        }
+        unsigned char length_bytes[sizeof(uint32_t)];
+        for (size_t i = 0; i < sizeof(length_bytes); ++i) {
+            length_bytes[i] = static_cast<unsigned char>(key.size() >> (i * CHAR_BIT));
+        }
+        out_.write(reinterpret_cast<const char*>(length_bytes), sizeof(length_bytes));
+        out_.write(key.data(), key.size());
+    }
+
+private:
+    std::ofstream out_;
+    KeyFileFormat format_;
+};
+
+// LIFO stack of trivially copyable records which keeps a single block in memory
+// and spills the rest to a temporary file
+template <class Record>
+class SpillStack {
+public:
+    explicit SpillStack(size_t block_size = 1 << 16)
+        : file_(nullptr, &std::fclose), buffer_(), block_size_(block_size), blocks_on_disk_(0) {
+        buffer_.reserve(block_size_);
+    }
+
+    void Push(const Record& record) {
+        if (buffer_.size() == block_size_) {
+            WriteBlock();
+        }
+        buffer_.push_back(record);
+    }
+
+    Record Pop() {
+        if (buffer_.empty()) {
+            ReadBlock();
+        }
+        Record record = buffer_.back();
+        buffer_.pop_back();
+        return record;
+    }
+
+    bool Empty() const {
+        return buffer_.empty() && blocks_on_disk_ == 0;
+    }
+
+    void Clear() {
+        buffer_.clear();
+        blocks_on_disk_ = 0;
+    }
+
+private:
+    void WriteBlock() {
+        if (!file_) {
+            file_.reset(std::tmpfile());
+            if (!file_) {
+                throw "Can't create temporary file";
+            }
+        }
+        std::fseek(file_.get(), static_cast<long>(blocks_on_disk_ * block_size_ * sizeof(Record)), SEEK_SET);
+        if (std::fwrite(buffer_.data(), sizeof(Record), buffer_.size(), file_.get()) != buffer_.size()) {
+            throw "Can't write to temporary file";
+        }
+        ++blocks_on_disk_;
+        buffer_.clear();
+    }
+
+    void ReadBlock() {
+        if (blocks_on_disk_ == 0) {
+            throw "Pop from empty SpillStack";
+        }
+        --blocks_on_disk_;
+        buffer_.resize(block_size_);
+        std::fseek(file_.get(), static_cast<long>(blocks_on_disk_ * block_size_ * sizeof(Record)), SEEK_SET);
+        if (std::fread(buffer_.data(), sizeof(Record), block_size_, file_.get()) != block_size_) {
+            throw "Can't read from temporary file";
+        }
+    }
+
+    std::unique_ptr<FILE, int(*)(FILE*)> file_;
+    std::vector<Record> buffer_;
+    size_t block_size_;
+    size_t blocks_on_disk_;
+};
+
+// Trivially copyable records written once and then read back in the same order,
+// a single block is kept in memory
+template <class Record>
+class RecordFile {
+public:
+    explicit RecordFile(size_t block_size = 1 << 16)
+        : file_(nullptr, &std::fclose), buffer_(), block_size_(block_size), size_(0), read_(0), position_(0) {
+        buffer_.reserve(block_size_);
+    }
+
+    // Must not be called after Next
+    void Push(const Record& record) {
+        if (buffer_.size() == block_size_) {
+            WriteBlock();
+        }
+        buffer_.push_back(record);
+        ++size_;
+    }
+
+    bool Next(Record& record) {
+        if (read_ == size_) {
+            return false;
+        }
+        if (read_ == 0 && file_) {
+            // The first call after the writes: the last block is still in memory
+            WriteBlock();
+            std::rewind(file_.get());
+        }
+        if (file_ && position_ == buffer_.size()) {
+            ReadBlock();
+        }
+        record = buffer_[position_++];
+        ++read_;
+        return true;
+    }
+
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+private:
+    void WriteBlock() {
+        if (!file_) {
+            file_.reset(std::tmpfile());
+            if (!file_) {
+                throw "Can't create temporary file";
+            }
+        }
+        if (std::fwrite(buffer_.data(), sizeof(Record), buffer_.size(), file_.get()) != buffer_.size()) {
+            throw "Can't write to temporary file";
+        }
+        buffer_.clear();
+        position_ = 0;
+    }
+
+    void ReadBlock() {
+        buffer_.resize(std::min(block_size_, size_ - read_));
+        if (std::fread(buffer_.data(), sizeof(Record), buffer_.size(), file_.get()) != buffer_.size()) {
+            throw "Can't read from temporary file";
+        }
+        position_ = 0;
+    }
+
+    std::unique_ptr<FILE, int(*)(FILE*)> file_;
+    std::vector<Record> buffer_;
+    size_t block_size_;
+    size_t size_;
+    size_t read_;
+    size_t position_;
+};
+
+// Sorts trivially copyable records that may not fit into memory: runs of run_records records are sorted
+// in memory and written to a temporary file, then the runs are merged with a block of each run in memory
+template <class Record, class Less>
+class ExternalSorter {
+public:
+    explicit ExternalSorter(Less less, size_t run_records = 1 << 20, size_t block_records = 1 << 12)
+        : file_(nullptr, &std::fclose), less_(less), run_records_(run_records), block_records_(block_records) {
+    }
+
+    // Must not be called after Sort
+    void Add(const Record& record) {
+        buffer_.push_back(record);
+        if (buffer_.size() == run_records_) {
+            WriteRun();
+        }
+    }
+
+    void Sort() {
+        if (runs_.empty()) {
+            std::sort(buffer_.begin(), buffer_.end(), less_);
+            return;
+        }
+        if (!buffer_.empty()) {
+            WriteRun();
+        }
+        buffer_ = std::vector<Record>();
+        for (size_t i = 0; i < runs_.size(); ++i) {
+            ReadBlock(runs_[i]);
+            heap_.push_back(i);
+        }
+        std::make_heap(heap_.begin(), heap_.end(), [this](size_t a, size_t b) {return RunGreater(a, b);});
+    }
+
+    // Records in sorted order, after Sort
+    bool Next(Record& record) {
+        if (runs_.empty()) {
+            if (position_ == buffer_.size()) {
+                return false;
+            }
+            record = buffer_[position_++];
+            return true;
+        }
+        if (heap_.empty()) {
+            return false;
+        }
+        auto greater = [this](size_t a, size_t b) {return RunGreater(a, b);};
+        std::pop_heap(heap_.begin(), heap_.end(), greater);
+        Run& run = runs_[heap_.back()];
+        record = run.block[run.position++];
+        if (run.position == run.block.size() && run.next == run.end) {
+            heap_.pop_back();
+            return true;
+        }
+        if (run.position == run.block.size()) {
+            ReadBlock(run);
+        }
+        std::push_heap(heap_.begin(), heap_.end(), greater);
+        return true;
+    }
+
+private:
+    // Records [begin, end) of the file, those from next on are not read yet
+    struct Run {
+        size_t begin;
+        size_t end;
+        size_t next;
+        std::vector<Record> block;
+        size_t position;
+    };
+
+    void WriteRun() {
+        if (!file_) {
+            file_.reset(std::tmpfile());
+            if (!file_) {
+                throw "Can't create temporary file";
+            }
+        }
+        std::sort(buffer_.begin(), buffer_.end(), less_);
+        size_t begin = runs_.empty() ? 0 : runs_.back().end;
+        std::fseek(file_.get(), static_cast<long>(begin * sizeof(Record)), SEEK_SET);
+        if (std::fwrite(buffer_.data(), sizeof(Record), buffer_.size(), file_.get()) != buffer_.size()) {
+            throw "Can't write to temporary file";
+        }
+        runs_.push_back({begin, begin + buffer_.size(), begin, std::vector<Record>(), 0});
+        buffer_.clear();
+    }
+
+    void ReadBlock(Run& run) {
+        run.block.resize(std::min(block_records_, run.end - run.next));
+        std::fseek(file_.get(), static_cast<long>(run.next * sizeof(Record)), SEEK_SET);
+        if (std::fread(run.block.data(), sizeof(Record), run.block.size(), file_.get()) != run.block.size()) {
+            throw "Can't read from temporary file";
+        }
+        run.next += run.block.size();
+        run.position = 0;
+    }
+
+    // Heap order: the run with the smallest current record on top
+    bool RunGreater(size_t a, size_t b) const {
+        return less_(runs_[b].block[runs_[b].position], runs_[a].block[runs_[a].position]);
+    }
+
+    std::unique_ptr<FILE, int(*)(FILE*)> file_;
+    Less less_;
+    size_t run_records_;
+    size_t block_records_;
+    std::vector<Record> buffer_;
+    size_t position_ = 0;
+    std::vector<Run> runs_;
+    std::vector<size_t> heap_;
+};
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <ostream>
+#include <vector>
+
 template <class T>
 struct SearchRange {
     T left;
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#include "consts.h"
+#include "elias_fano.h"
+#include "filter.h"
+
+// Range filter for integer keys (Grafite).
+// Keys are mapped to [0, universe_) by h(x) = (q(x / L) + x) mod universe_, where q is a random hash
+// of the block of L consecutive keys. h keeps the order inside a block, so a range no longer than L
+// turns into at most two blocks of consecutive hashes, each checked by one Elias-Fano successor query.
+// Longer ranges are checked block by block, up to kMaxRangeBlocks blocks, and reported as non-empty beyond that.
+// With universe_ = n * L / eps the false positive rate of such ranges is at most eps.
+template <class T>
+class GrafiteFilter : public Filter<T> {
+    static_assert(std::is_integral<T>::value, "Grafite filter supports only integer keys");
+public:
+    GrafiteFilter() = default;
+
+    template <class Generator>
+    void Init(Generator& generator,
+              uint64_t max_range_length = kDefaultGrafiteMaxRangeLength,
+              double false_positive_rate = kDefaultGrafiteFalsePositiveRate) {
+        if (max_range_length == 0 || false_positive_rate <= 0.0 || false_positive_rate > 1.0) {
+            throw "Grafite filter needs max_range_length > 0 and 0 < false_positive_rate <= 1";
+        }
+        std::uniform_int_distribution<uint64_t> distribution;
+        hash_multiplier_ = distribution(generator) | 1;
+        hash_increment_ = distribution(generator);
+        max_range_length_ = max_range_length;
+        false_positive_rate_ = false_positive_rate;
+    }
+
+    void Build(const std::vector<T>& values) override {
+        double universe = std::ceil(std::max<size_t>(values.size(), 1) * static_cast<double>(max_range_length_) / false_positive_rate_);
+        universe_ = std::max<double>(std::min(universe, static_cast<double>(kMaxUniverse)), max_range_length_);
+
+        std::vector<uint64_t> hashes;
+        hashes.reserve(values.size());
+        for (const auto& x : values) {
+            hashes.push_back(Hash(ToUnsigned(x)));
+        }
+        std::sort(hashes.begin(), hashes.end());
+        hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+        hashes_.Build(hashes, universe_);
+    }
+
+    bool Find(const T& value) const override {
+        return FindRange(value, value);
+    }
+
+    bool FindRange(const T& left, const T& right) const {
+        uint64_t from = ToUnsigned(left);
+        uint64_t to = ToUnsigned(right);
+        if (from > to) {
+            return false;
+        }
+        // Each block is one query, ranges touching more than kMaxRangeBlocks blocks are not checked
+        if (to / max_range_length_ - from / max_range_length_ >= kMaxRangeBlocks) {
+            return true;
+        }
+        while (true) {
+            uint64_t block_end = from + (max_range_length_ - 1 - from % max_range_length_);
+            if (block_end >= to) {
+                return FindInBlock(from, to);
+            }
+            if (FindInBlock(from, block_end)) {
+                return true;
+            }
+            from = block_end + 1;
+        }
+    }
+
+    bool FindRange(const SearchRange<T>& range) const override {
+        return FindRange(range.left, range.right);
+    }
+
+    bool GetHashTableSizeBits(size_t& size) const override {
+        size = hashes_.BitsSize();
+        return true;
+    }
+
+    bool GetUsedSpaceBits(size_t& size) const override {
+        return GetHashTableSizeBits(size);
+    }
+
+private:
+    // Order-preserving map to unsigned values
+    static uint64_t ToUnsigned(T x) {
+        uint64_t result = static_cast<typename std::make_unsigned<T>::type>(x);
+        if (std::is_signed<T>::value) {
+            result ^= static_cast<uint64_t>(1) << (sizeof(T) * CHAR_BIT - 1);
+        }
+        return result;
+    }
+
+    uint64_t BlockHash(uint64_t block) const {
+        uint64_t x = block * hash_multiplier_ + hash_increment_;
+        x ^= x >> 31;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 29;
+        return x % universe_;
+    }
+
+    uint64_t Hash(uint64_t x) const {
+        return (BlockHash(x / max_range_length_) + x % max_range_length_) % universe_;
+    }
+
+    // from and to are in the same block, so their hashes form a cyclic interval
+    bool FindInBlock(uint64_t from, uint64_t to) const {
+        uint64_t start = Hash(from);
+        uint64_t end = start + (to - from);
+        uint64_t successor = 0;
+        if (!hashes_.Successor(start, successor)) {
+            return end >= universe_ && hashes_.Successor(0, successor) && successor <= end - universe_;
+        }
+        return successor <= end;
+    }
+
+    static const uint64_t kMaxUniverse = static_cast<uint64_t>(1) << 62;
+    static const uint64_t kMaxRangeBlocks = 4;
+
+    EliasFano hashes_;
+    uint64_t hash_multiplier_ = 1;
+    uint64_t hash_increment_ = 0;
+    uint64_t max_range_length_ = kDefaultGrafiteMaxRangeLength;
+    double false_positive_rate_ = kDefaultGrafiteFalsePositiveRate;
+    uint64_t universe_ = 1;
+};
@@ -1,7 +1,10 @@
 #pragma once
 
 #include <climits>
+#include <cstdint>
+#include <cstring>
 #include <random>
+#include <string_view>
 
 template <class Generator>
 int RandomInt(Generator& generator, int lower, int upper) {
@@ -47,4 +50,33 @@ public:
         int64_t second = RandomInt(generator, 0, std::numeric_limits<int>::max());
         return LinearHashFunction(first, second, prime);
     }
-};
\ No newline at end of file
+};
+
+// 64x64 -> 128-bit multiplication folded to 64 bits
+inline uint64_t MultiplyFold(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+// Fast 64-bit hash of a byte string (wyhash-like): 16 bytes are mixed per step by one
+// multiplication, the tail is zero-padded to 16 bytes
+inline uint64_t StringHash(std::string_view s, uint64_t seed = 0) {
+    const uint64_t kFirstSecret = 0xa0761d6478bd642full;
+    const uint64_t kSecondSecret = 0xe7037ed1a0b428dbull;
+    auto read = [&s](size_t i) {
+        uint64_t word;
+        std::memcpy(&word, s.data() + i, sizeof(word));
+        return word;
+    };
+    uint64_t hash = seed ^ kFirstSecret;
+    size_t i = 0;
+    for (; i + 2 * sizeof(uint64_t) <= s.size(); i += 2 * sizeof(uint64_t)) {
+        hash = MultiplyFold(read(i) ^ kSecondSecret, read(i + sizeof(uint64_t)) ^ hash);
+    }
+    if (i < s.size()) {
+        uint64_t tail[2] = {0, 0};
+        std::memcpy(tail, s.data() + i, s.size() - i);
+        hash = MultiplyFold(tail[0] ^ kSecondSecret, tail[1] ^ hash);
+    }
+    return MultiplyFold(hash ^ kFirstSecret, s.size() ^ kSecondSecret);
+}
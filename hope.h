@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "compressed_vector.h"
+#include "consts.h"
+
+// Order-preserving key compression (HOPE-style).
+// The dictionary splits all strings into intervals [starts_[i], starts_[i + 1]). Boundaries are the bytes
+// seen in the sample and frequent n-grams g with their successors Next(g), so every string of the interval
+// of a boundary starts with the longest symbol (sampled byte or n-gram) which is a prefix of the boundary.
+// A key is encoded symbol by symbol: the code of its interval, and for intervals without a symbol (bytes
+// not seen in the sample) the raw byte. Codes are an optimal alphabetic (Hu-Tucker) code for the interval
+// frequencies in the sample: they are prefix-free and grow with intervals, so a < b gives Encode(a) <= Encode(b),
+// and equal codes consume equal symbols, so the encoding is lossless.
+// Bits are packed by 7 into bytes 1..128: the order is kept and encoded keys have no zero bytes.
+class HopeEncoder {
+public:
+    HopeEncoder() : starts_(), symbol_lengths_(), byte_starts_(), codes_(), code_lengths_(), compression_ratio_(1.0) {
+    }
+
+    // Dictionaries of up to dictionary_size intervals are tried with more and more n-grams,
+    // the one with the smallest size of the encoded keys plus the dictionary is kept
+    void Build(const std::vector<std::string>& keys,
+               size_t dictionary_size = kDefaultHopeDictionarySize,
+               size_t sample_size = kDefaultHopeSampleSize) {
+        size_t step = std::max<size_t>(keys.size() / std::max<size_t>(sample_size, 1), 1);
+        std::vector<std::string_view> sample;
+        size_t sample_bytes = 0;
+        for (size_t i = 0; i < keys.size(); i += step) {
+            sample.push_back(keys[i]);
+            sample_bytes += keys[i].size();
+        }
+
+        // n-grams by the number of bytes they save, each adds at most two boundaries
+        std::unordered_map<std::string_view, size_t> counts;
+        for (const auto& key : sample) {
+            for (size_t i = 0; i < key.size(); ++i) {
+                for (size_t length = 2; length <= kHopeMaxGramLength && i + length <= key.size(); ++length) {
+                    ++counts[key.substr(i, length)];
+                }
+            }
+        }
+        std::vector<std::pair<size_t, std::string_view>> grams;
+        for (const auto& [gram, count] : counts) {
+            if (count > 1) {
+                grams.emplace_back(count * (gram.size() - 1), gram);
+            }
+        }
+        std::sort(grams.begin(), grams.end(), [](const auto& a, const auto& b) {
+            return a.first > b.first || (a.first == b.first && a.second < b.second);
+        });
+
+        double keys_per_sample_key = sample.empty() ? 0.0 : static_cast<double>(keys.size()) / sample.size();
+        double best_bits = 0.0;
+        size_t max_grams = 0;
+        while (true) {
+            HopeEncoder candidate;
+            size_t used_grams = candidate.BuildDictionary(sample, grams, max_grams, dictionary_size);
+            size_t encoded_bytes = candidate.EncodedBytes(sample);
+            double bits = encoded_bytes * CHAR_BIT * keys_per_sample_key + candidate.BitsSize();
+            if (max_grams == 0 || bits < best_bits) {
+                *this = std::move(candidate);
+                best_bits = bits;
+                compression_ratio_ = sample_bytes == 0 ? 1.0 : static_cast<double>(encoded_bytes) / sample_bytes;
+            }
+            if (used_grams < max_grams || used_grams == grams.size()) {
+                break;
+            }
+            max_grams = std::max<size_t>(max_grams * 2, kHopeMinGrams);
+        }
+    }
+
+    void Encode(std::string_view key, std::string& result) const {
+        result.clear();
+        BitWriter writer(result);
+        size_t pos = 0;
+        while (pos < key.size()) {
+            size_t interval = FindInterval(key.substr(pos));
+            writer.Write(codes_.GetValueByIndex(interval), code_lengths_.GetValueByIndex(interval));
+            size_t symbol_length = symbol_lengths_.GetValueByIndex(interval);
+            if (symbol_length == 0) {
+                writer.Write(static_cast<unsigned char>(key[pos]), CHAR_BIT);
+                ++pos;
+            } else {
+                pos += symbol_length;
+            }
+        }
+        writer.Flush();
+    }
+
+    size_t Size() const {
+        return starts_.size();
+    }
+
+    // Encoded size of the sampled keys divided by their size
+    double CompressionRatio() const {
+        return compression_ratio_;
+    }
+
+    // Memory used, in bits
+    size_t BitsSize() const {
+        size_t size = symbol_lengths_.BitsSize() + byte_starts_.BitsSize() + codes_.BitsSize() + code_lengths_.BitsSize();
+        for (const auto& start : starts_) {
+            size += (start.size() + 1) * CHAR_BIT;
+        }
+        return size;
+    }
+
+private:
+    class BitWriter {
+    public:
+        explicit BitWriter(std::string& result) : result_(result), buffer_(0), buffered_(0) {
+        }
+
+        // bits <= 32
+        void Write(uint64_t value, size_t bits) {
+            buffer_ = (buffer_ << bits) | value;
+            buffered_ += bits;
+            while (buffered_ >= kChunkBits) {
+                buffered_ -= kChunkBits;
+                result_.push_back(static_cast<char>(((buffer_ >> buffered_) & kChunkMask) + 1));
+            }
+        }
+
+        void Flush() {
+            if (buffered_ > 0) {
+                result_.push_back(static_cast<char>(((buffer_ << (kChunkBits - buffered_)) & kChunkMask) + 1));
+                buffer_ = 0;
+                buffered_ = 0;
+            }
+        }
+
+    private:
+        static const size_t kChunkBits = CHAR_BIT - 1;
+        static const uint64_t kChunkMask = (1 << kChunkBits) - 1;
+
+        std::string& result_;
+        uint64_t buffer_;
+        size_t buffered_;
+    };
+
+    // Dictionary of the sampled bytes and at most max_grams first grams which fit into dictionary_size intervals,
+    // returns the number of grams added
+    size_t BuildDictionary(const std::vector<std::string_view>& sample,
+                           const std::vector<std::pair<size_t, std::string_view>>& grams,
+                           size_t max_grams, size_t dictionary_size) {
+        std::unordered_set<std::string> symbols;
+        std::vector<std::string> boundaries = {"", std::string(1, '\0')};
+        bool seen[1 << CHAR_BIT] = {};
+        for (const auto& key : sample) {
+            for (const auto c : key) {
+                seen[static_cast<unsigned char>(c)] = true;
+            }
+        }
+        for (size_t c = 0; c < (1 << CHAR_BIT); ++c) {
+            if (seen[c]) {
+                std::string symbol(1, static_cast<char>(c));
+                AddSymbol(symbol, symbols, boundaries);
+            }
+        }
+        size_t used_grams = 0;
+        for (; used_grams < std::min(max_grams, grams.size()); ++used_grams) {
+            if (boundaries.size() + 2 > dictionary_size) {
+                break;
+            }
+            AddSymbol(std::string(grams[used_grams].second), symbols, boundaries);
+        }
+
+        std::sort(boundaries.begin(), boundaries.end());
+        boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+        starts_ = std::move(boundaries);
+        symbol_lengths_ = CompressedVector<uint8_t>(starts_.size(), BitsFor(kHopeMaxGramLength));
+        for (size_t i = 0; i < starts_.size(); ++i) {
+            for (size_t length = std::min(starts_[i].size(), kHopeMaxGramLength); length > 0; --length) {
+                if (symbols.count(starts_[i].substr(0, length))) {
+                    symbol_lengths_.SetValueByIndex(i, length);
+                    break;
+                }
+            }
+        }
+        byte_starts_ = CompressedVector<uint32_t>((1 << CHAR_BIT) + 1, BitsFor(starts_.size()));
+        for (size_t c = 0; c < (1 << CHAR_BIT); ++c) {
+            auto start = std::lower_bound(starts_.begin(), starts_.end(), std::string(1, static_cast<char>(c)));
+            byte_starts_.SetValueByIndex(c, start - starts_.begin());
+        }
+        byte_starts_.SetValueByIndex(1 << CHAR_BIT, starts_.size());
+
+        // Every interval gets a code, even if the sample never uses it
+        std::vector<uint64_t> weights(starts_.size(), 1);
+        for (const auto& key : sample) {
+            for (size_t pos = 0; pos < key.size();) {
+                size_t interval = FindInterval(key.substr(pos));
+                ++weights[interval];
+                pos += std::max<size_t>(symbol_lengths_.GetValueByIndex(interval), 1);
+            }
+        }
+        AssignCodes(weights);
+        return used_grams;
+    }
+
+    // Interval of the string starting with rest
+    size_t FindInterval(std::string_view rest) const {
+        // Boundaries starting with other bytes are all less or all greater than rest
+        size_t first = static_cast<unsigned char>(rest[0]);
+        return std::upper_bound(starts_.begin() + byte_starts_.GetValueByIndex(first),
+                                starts_.begin() + byte_starts_.GetValueByIndex(first + 1), rest,
+                                [](std::string_view x, const std::string& start) { return x < start; })
+               - starts_.begin() - 1;
+    }
+
+    size_t EncodedBytes(const std::vector<std::string_view>& keys) const {
+        size_t bytes = 0;
+        std::string encoded;
+        for (const auto& key : keys) {
+            Encode(key, encoded);
+            bytes += encoded.size();
+        }
+        return bytes;
+    }
+
+    // Canonical alphabetic codes: each code is the next one after the previous code, cut or extended to its length.
+    // Rare intervals get the weights raised until no code is longer than kHopeMaxCodeBits
+    void AssignCodes(std::vector<uint64_t> weights) {
+        uint64_t total = 0;
+        for (auto weight : weights) {
+            total += weight;
+        }
+        std::vector<uint8_t> lengths;
+        for (uint64_t floor = total >> kHopeMaxCodeBits; ; floor = std::max<uint64_t>(floor * 2, 1)) {
+            for (auto& weight : weights) {
+                weight = std::max(weight, floor);
+            }
+            lengths = AlphabeticCodeLengths(weights);
+            if (*std::max_element(lengths.begin(), lengths.end()) <= kHopeMaxCodeBits) {
+                break;
+            }
+        }
+        size_t max_length = *std::max_element(lengths.begin(), lengths.end());
+        codes_ = CompressedVector<uint32_t>(lengths.size(), max_length);
+        code_lengths_ = CompressedVector<uint8_t>(lengths.size(), BitsFor(max_length));
+        uint64_t code = 0;
+        for (size_t i = 0; i < lengths.size(); ++i) {
+            if (i > 0 && lengths[i] >= lengths[i - 1]) {
+                code = (code + 1) << (lengths[i] - lengths[i - 1]);
+            } else if (i > 0) {
+                code = (code + 1) >> (lengths[i - 1] - lengths[i]);
+            }
+            codes_.SetValueByIndex(i, static_cast<uint32_t>(code));
+            code_lengths_.SetValueByIndex(i, lengths[i]);
+        }
+    }
+
+    // Bits needed to store the numbers from 0 to max_value
+    static size_t BitsFor(size_t max_value) {
+        size_t bits = 1;
+        while ((max_value >> bits) > 0) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    // Depths of the leaves of the optimal alphabetic tree (Garsia-Wachs): the first pair of nodes whose right
+    // neighbour is not lighter than the left node is joined, and the joined node moves left past lighter nodes.
+    // The leaves get the same depths as in the optimal tree keeping their order
+    static std::vector<uint8_t> AlphabeticCodeLengths(const std::vector<uint64_t>& weights) {
+        size_t leaves = weights.size();
+        if (leaves == 1) {
+            return {1};
+        }
+        std::vector<uint64_t> node_weights = weights;
+        std::vector<size_t> parents(2 * leaves - 1, 0);
+        std::vector<size_t> sequence(leaves);
+        for (size_t i = 0; i < leaves; ++i) {
+            sequence[i] = i;
+        }
+        while (sequence.size() > 1) {
+            size_t k = 1;
+            while (k + 1 < sequence.size() && node_weights[sequence[k - 1]] > node_weights[sequence[k + 1]]) {
+                ++k;
+            }
+            size_t node = node_weights.size();
+            node_weights.push_back(node_weights[sequence[k - 1]] + node_weights[sequence[k]]);
+            parents[sequence[k - 1]] = node;
+            parents[sequence[k]] = node;
+            sequence.erase(sequence.begin() + k - 1, sequence.begin() + k + 1);
+            size_t j = k - 1;
+            while (j > 0 && node_weights[sequence[j - 1]] < node_weights[node]) {
+                --j;
+            }
+            sequence.insert(sequence.begin() + j, node);
+        }
+        // Parents are created after their children
+        std::vector<uint8_t> depths(node_weights.size(), 0);
+        for (size_t node = node_weights.size() - 1; node-- > 0;) {
+            depths[node] = depths[parents[node]] + 1;
+        }
+        depths.resize(leaves);
+        return depths;
+    }
+
+    // Adds the boundaries of the strings starting with symbol: the symbol and the first string after them.
+    // There is no such string if the symbol is all 0xff bytes, then all strings from the symbol on start with it
+    static void AddSymbol(const std::string& symbol, std::unordered_set<std::string>& symbols, std::vector<std::string>& boundaries) {
+        std::string next = symbol;
+        while (!next.empty() && static_cast<unsigned char>(next.back()) == UCHAR_MAX) {
+            next.pop_back();
+        }
+        if (!next.empty()) {
+            ++next.back();
+            boundaries.push_back(next);
+        }
+        symbols.insert(symbol);
+        boundaries.push_back(symbol);
+    }
+
+    std::vector<std::string> starts_;
+    CompressedVector<uint8_t> symbol_lengths_;
+    // Index of the first boundary starting with byte c (or a greater one)
+    CompressedVector<uint32_t> byte_starts_;
+    CompressedVector<uint32_t> codes_;
+    CompressedVector<uint8_t> code_lengths_;
+    double compression_ratio_;
+};
@@ -1,21 +1,43 @@
 #include <chrono>
+#include <cstdio>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "bloom_filter.h"
 #include "consts.h"
 #include "cuckoo_filter.h"
+#include "grafite_filter.h"
 #include "vacuum_filter.h"
 #include "hash.h"
 #include "hash_set_filter.h"
+#include "rosetta.h"
 #include "surf.h"
 #include "testdata.h"
 #include "xor_filter.h"
 
 
+// Xor filter built through a key file, the keys are written in the length-prefixed format
+class FileXorFilter : public XorFilter<std::string> {
+public:
+    void Build(const std::vector<std::string>& values) override {
+        std::vector<std::string> keys = values;
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        {
+            KeyFileWriter writer(kXorKeyFileName, KeyFileFormat::LengthPrefixed);
+            for (const auto& key : keys) {
+                writer.Write(key);
+            }
+        }
+        BuildFromFile(kXorKeyFileName, KeyFileFormat::LengthPrefixed);
+        std::remove(kXorKeyFileName);
+    }
+};
+
 template <class Function>
 void MeasureTime(std::string label, Function f) {
     auto t1 = std::chrono::high_resolution_clock::now();
@@ -173,6 +195,61 @@ void RunRangeTest(Filter<T>& filter, TestData<T, Generator> test_data, size_t it
     std::cout << "found " << found << " of " << out_ranges.size() << " (" << percent_found << "%)\n";
 }
 
+template <class T, class Generator>
+void RunRetrievalTest(TestData<T, Generator> test_data, size_t items_count, double buckets_count_coefficient, size_t additional_buckets) {
+    std::vector<T> items;
+    for (size_t i = 0; i < items_count; ++i) {
+        items.push_back(test_data.NewItem());
+    }
+    std::sort(items.begin(), items.end());
+    items.erase(std::unique(items.begin(), items.end()), items.end());
+
+    std::vector<HashTableInt> values;
+    std::uniform_int_distribution<HashTableInt> distribution(0, (1 << kRetrievalValueBits) - 1);
+    std::mt19937 rng(15);
+    for (size_t i = 0; i < items.size(); ++i) {
+        values.push_back(distribution(rng));
+    }
+
+    XorRetrieval<T, kRetrievalValueBits> retrieval;
+    retrieval.Init(buckets_count_coefficient, additional_buckets);
+    MeasureTime("Retrieval build", [&](){retrieval.Build(items, values);});
+    std::cerr << "Put " << items.size() << " items\n";
+
+    size_t size = 0;
+    retrieval.GetHashTableSizeBits(size);
+    std::cout << "Hash tables size (in bits):  " << size << "\n";
+    std::cout << "Bits per item: " << static_cast<double>(size) / items.size() << "\n";
+
+    size_t correct = 0;
+    MeasureTime("Checking values", [&]() {
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (retrieval.Get(items[i]) == values[i]) {
+                ++correct;
+            }
+        }
+    });
+    double percent_correct = 100 * static_cast<double>(correct) / items.size();
+    std::cout << "Values check (required 100%): ";
+    std::cout << "correct " << correct << " of " << items.size() << " (" << percent_correct << "%)\n";
+}
+
+template <class T, class Generator>
+void RunRetrievalTestCase(TestData<T, Generator> test_data, size_t items_count, const std::string& label, int argc, char** argv) {
+    double buckets_count_coefficient = kDefaultBucketsCountCoefficient;
+    size_t additional_buckets = kDefaultAdditionalBuckets;
+    if (argc > 4) {
+        buckets_count_coefficient = std::stod(argv[4]);
+    }
+    if (argc > 5) {
+        additional_buckets = std::stoi(argv[5]);
+    }
+
+    std::cout << "TEST CASE: " << label << "\n\n";
+    RunRetrievalTest(test_data, items_count, buckets_count_coefficient, additional_buckets);
+    std::cout << "_______________________________________\n\n";
+}
+
 template <class T, class Generator>
 void RunTestCase(Filter<T>& filter, TestData<T, Generator> test_data, size_t items_count, const std::string& label, bool range = false) {
     std::cout << "TEST CASE: " << label << "\n\n";
@@ -243,7 +320,7 @@ std::unique_ptr<Filter<T>> GetFilter(int argc, char** argv, Generator& generator
         ptr->Init(expected_size, fingerprint_size_bits, max_num_kicks);
         return ptr;
     }
-    if (name == "xor") {
+    if (name == "xor" || name == "xor_file") {
         size_t fingerprint_size_bits = kDefaultFingerprintSizeBits;
         double buckets_count_coefficient = kDefaultBucketsCountCoefficient;
         size_t additional_buckets = kDefaultAdditionalBuckets;
@@ -258,15 +335,30 @@ std::unique_ptr<Filter<T>> GetFilter(int argc, char** argv, Generator& generator
             additional_buckets = std::stoi(argv[6]);
         }
 
-        auto ptr = std::make_unique<XorFilter<T>>();
-        ptr->Init(fingerprint_size_bits, buckets_count_coefficient, additional_buckets);
-        return ptr;
+        if (name == "xor") {
+            auto ptr = std::make_unique<XorFilter<T>>();
+            ptr->Init(fingerprint_size_bits, buckets_count_coefficient, additional_buckets);
+            return ptr;
+        }
+        if constexpr (std::is_same<T, std::string>::value) {
+            auto ptr = std::make_unique<FileXorFilter>();
+            ptr->Init(fingerprint_size_bits, buckets_count_coefficient, additional_buckets);
+            return ptr;
+        } else {
+            throw "Xor filter file build supports only string test data: text, real, words";
+        }
     }
     if (name == "surf" || name == "surf_range") {
         SuffixType s_type = SuffixType::Hash;
         size_t suffix_size = kDefaultSurfSuffixSize;
         int fixed_length = kDefaultFixedLengthValue;
         double cut_gain_threshold = kDefaultCutGainThreshold;
+        size_t hash_suffix_size = kDefaultSurfSuffixSize;
+        bool auto_tune = false;
+        bool compress = false;
+        bool reduce_labels = false;
+        double bits_per_key = kDefaultSurfBitsPerKey;
+        size_t build_threads = kDefaultSurfBuildThreads;
 
         if (argc > 4) {
             std::string type = argv[4];
@@ -274,23 +366,93 @@ std::unique_ptr<Filter<T>> GetFilter(int argc, char** argv, Generator& generator
                 s_type = SuffixType::Empty;
             } else if (type == "real") {
                 s_type = SuffixType::Real;
+            } else if (type == "mixed") {
+                s_type = SuffixType::Mixed;
+            } else if (type == "auto") {
+                auto_tune = true;
             }
         }
         if (argc > 5) {
-            suffix_size = std::stoi(argv[5]);
+            if (auto_tune) {
+                bits_per_key = std::stod(argv[5]);
+            } else {
+                suffix_size = std::stoi(argv[5]);
+            }
         }
         if (argc > 6) {
             fixed_length = std::stoi(argv[6]);
         }
+        // Tune chooses cut_gain_threshold and hash_suffix_size in the auto mode, the other positions are the same
         if (argc > 7) {
             cut_gain_threshold = std::stod(argv[7]);
         }
+        if (argc > 8) {
+            hash_suffix_size = std::stoi(argv[8]);
+        }
+        if (argc > 9) {
+            compress = std::stoi(argv[9]) != 0;
+        }
+        if (argc > 10) {
+            reduce_labels = std::stoi(argv[10]) != 0;
+        }
+        if (argc > 11) {
+            build_threads = std::stoi(argv[11]);
+        }
 
         auto ptr = std::make_unique<SuccinctRangeFilter<T>>();
-        ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+        ptr->SetBuildThreads(build_threads);
+        if (auto_tune) {
+            ptr->InitAuto(bits_per_key, name == "surf_range", fixed_length);
+        } else {
+            ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
+        }
+        if (compress) {
+            ptr->EnableCompression();
+        }
+        if (reduce_labels) {
+            ptr->EnableReducedLabels();
+        }
         return ptr;
     }
-    throw "Unknown filter name. Use one of: bloom, cuckoo, xor, vacuum, surf, surf_range";
+    if (name == "grafite") {
+        if constexpr (std::is_integral<T>::value) {
+            uint64_t max_range_length = kDefaultGrafiteMaxRangeLength;
+            double false_positive_rate = kDefaultGrafiteFalsePositiveRate;
+
+            if (argc > 4) {
+                max_range_length = std::stoull(argv[4]);
+            }
+            if (argc > 5) {
+                false_positive_rate = std::stod(argv[5]);
+            }
+
+            auto ptr = std::make_unique<GrafiteFilter<T>>();
+            ptr->Init(generator, max_range_length, false_positive_rate);
+            return ptr;
+        } else {
+            throw "Grafite filter supports only integer test data: uniform, zipf";
+        }
+    }
+    if (name == "rosetta") {
+        if constexpr (std::is_integral<T>::value) {
+            uint64_t max_range_length = kDefaultRosettaMaxRangeLength;
+            double bits_per_key = kDefaultRosettaBitsPerKey;
+
+            if (argc > 4) {
+                max_range_length = std::stoull(argv[4]);
+            }
+            if (argc > 5) {
+                bits_per_key = std::stod(argv[5]);
+            }
+
+            auto ptr = std::make_unique<RosettaFilter<T>>();
+            ptr->Init(generator, max_range_length, bits_per_key);
+            return ptr;
+        } else {
+            throw "Rosetta filter supports only integer test data: uniform, zipf";
+        }
+    }
+    throw "Unknown filter name. Use one of: bloom, cuckoo, xor, xor_file, vacuum, surf, surf_range, grafite, rosetta";
 }
 
 int main(int argc, char** argv) {
@@ -300,13 +462,18 @@ int main(int argc, char** argv) {
         std::cerr << "Cuckoo filter params: [max_buckets_count] [bucket_size] [fingerprint_size_bits] [max_num_kicks]\n";
         std::cerr << "Vacuum filter params: [fingerprint_size_bits] [max_num_kicks]\n";
         std::cerr << "Xor filter params: [fingerprint_size_bits] [buckets_count_coefficient] [additional_buckets]\n";
-        std::cerr << "SuRF params: [suffix_type] [suffix_size] [fix_length] [cut_gain_threshold]\n";
+        std::cerr << "Xor filter built from a key file (xor_file) params: same as xor\n";
+        std::cerr << "Xor retrieval params: [buckets_count_coefficient] [additional_buckets]\n";
+        std::cerr << "SuRF params: [suffix_type] [suffix_size] [fix_length] [cut_gain_threshold] [hash_suffix_size] [compress] [reduce_labels] [build_threads]\n";
+        std::cerr << "SuRF params with a space budget: auto [bits_per_key] [fix_length] [cut_gain_threshold] [hash_suffix_size] [compress] [reduce_labels] [build_threads], cut_gain_threshold and hash_suffix_size are ignored\n";
+        std::cerr << "Grafite params: [max_range_length] [false_positive_rate]\n";
+        std::cerr << "Rosetta params: [max_range_length] [bits_per_key]\n";
         return 1;
     }
 
     bool range = false;
     std::string filter_name = argv[1];
-    if (filter_name == "surf_range") {
+    if (filter_name == "surf_range" || filter_name == "grafite" || filter_name == "rosetta") {
         range = true;
     }
 
@@ -324,6 +491,23 @@ int main(int argc, char** argv) {
 
     std::cout << std::fixed << std::setprecision(2);
 
+    // Retrieval maps keys to values, it is checked for the stored values instead of false positives
+    if (filter_name == "xor_retrieval") {
+        if (test_data == "uniform" || test_data == "all") {
+            UniformIntTestData<std::mt19937> g(generator, kMinNumber, kMaxNumber);
+            RunRetrievalTestCase(TestData<int, UniformIntTestData<std::mt19937>>(g), items_count, "Uniform distribution for integers", argc, argv);
+        }
+        if (test_data == "zipf" || test_data == "all") {
+            ZipfMandelbrotIntTestData<std::mt19937> zm(generator, 1.13, 2.73, 1000000);
+            RunRetrievalTestCase(TestData<int, ZipfMandelbrotIntTestData<std::mt19937>>(zm), items_count, "Zipf-mandelbrot distribution for integers", argc, argv);
+        }
+        if (test_data == "text" || test_data == "all") {
+            RandomTextTestData<std::mt19937> g(generator, 5, 100);
+            RunRetrievalTestCase(TestData<std::string, RandomTextTestData<std::mt19937>>(g), items_count, "Random strings", argc, argv);
+        }
+        return 0;
+    }
+
     if (test_data == "uniform" || test_data == "all") {
         std::unique_ptr<Filter<int>> filter_to_test = GetFilter<int>(argc, argv, generator);
         UniformIntTestData<std::mt19937> g(generator, kMinNumber, kMaxNumber);
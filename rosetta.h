@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <type_traits>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "consts.h"
+#include "filter.h"
+
+// Range filter for integer keys (Rosetta).
+// Level h keeps a Bloom filter of the key prefixes x >> h, so a prefix at level h stands for the dyadic interval
+// of 2^h keys. A range is split into dyadic intervals top-down: an interval is dropped as soon as the filter of its
+// level doesn't contain it, otherwise its halves are checked one level below, down to single keys.
+// The walk reaches the dyadic decomposition of the range through the intervals sticking out of its ends, and those
+// are probed too: a missing one drops all the short intervals at that end at once.
+// The levels cover intervals up to the power of two not less than max_range_length, so such a range starts from
+// at most two top intervals, longer ranges start from one more per 2^(levels - 1) keys.
+// Memory is split between the levels by a greedy optimiser: bits per prefix go to the level where they lower
+// the expected false positive rate the most per bit spent. The rate is computed exactly for the probes above
+// on a sample of empty ranges of length up to max_range_length around the built keys.
+template <class T>
+class RosettaFilter : public Filter<T> {
+    static_assert(std::is_integral<T>::value, "Rosetta filter supports only integer keys");
+public:
+    RosettaFilter() = default;
+
+    template <class Generator>
+    void Init(Generator& generator,
+              uint64_t max_range_length = kDefaultRosettaMaxRangeLength,
+              double bits_per_key = kDefaultRosettaBitsPerKey) {
+        if (max_range_length == 0 || bits_per_key <= 0.0) {
+            throw "Rosetta filter needs max_range_length > 0 and bits_per_key > 0";
+        }
+        levels_count_ = 1;
+        while (levels_count_ < kKeyBits && (static_cast<uint64_t>(1) << (levels_count_ - 1)) < max_range_length) {
+            ++levels_count_;
+        }
+        max_range_length_ = max_range_length;
+        bits_per_key_ = bits_per_key;
+        // Bloom filters are sized on Build, their hash functions are drawn from this seed
+        seed_ = std::uniform_int_distribution<uint32_t>()(generator);
+    }
+
+    void Build(const std::vector<T>& values) override {
+        std::vector<uint64_t> keys;
+        keys.reserve(values.size());
+        for (const auto& x : values) {
+            keys.push_back(ToUnsigned(x));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        keys_count_ = keys.size();
+        levels_.assign(levels_count_, BloomFilter<int>());
+        bits_per_prefix_.assign(levels_count_, 0);
+        if (keys.empty()) {
+            return;
+        }
+
+        std::vector<size_t> prefixes_count(levels_count_, 0);
+        for (size_t h = 0; h < levels_count_; ++h) {
+            for (size_t i = 0; i < keys.size(); ++i) {
+                prefixes_count[h] += i == 0 || (keys[i] >> h) != (keys[i - 1] >> h);
+            }
+        }
+        bits_per_prefix_ = SplitBits(keys, prefixes_count, bits_per_key_ * keys.size());
+        point_level_ = 0;
+        while (point_level_ + 1 < levels_count_ && bits_per_prefix_[point_level_] == 0) {
+            ++point_level_;
+        }
+
+        std::mt19937 generator(seed_);
+        for (size_t h = 0; h < levels_count_; ++h) {
+            if (bits_per_prefix_[h] == 0) {
+                continue;
+            }
+            levels_[h].Init(generator, prefixes_count[h] * bits_per_prefix_[h], HashFunctionsCount(bits_per_prefix_[h]));
+            for (size_t i = 0; i < keys.size(); ++i) {
+                if (i == 0 || (keys[i] >> h) != (keys[i - 1] >> h)) {
+                    levels_[h].Add(PrefixKey(keys[i] >> h));
+                }
+            }
+        }
+    }
+
+    // A single probe of the lowest level with bits: the full keys, unless the split gave them nothing since
+    // the configured ranges are much longer than the gaps between keys
+    bool Find(const T& value) const override {
+        return keys_count_ > 0 && MayContain(ToUnsigned(value) >> point_level_, point_level_);
+    }
+
+    bool FindRange(const T& left, const T& right) const {
+        uint64_t from = ToUnsigned(left);
+        uint64_t to = ToUnsigned(right);
+        if (from > to || keys_count_ == 0) {
+            return false;
+        }
+        size_t top = levels_count_ - 1;
+        for (uint64_t prefix = from >> top; prefix <= (to >> top); ++prefix) {
+            if (FindInInterval(prefix, top, from, to)) {
+                return true;
+            }
+            if (prefix == (to >> top)) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    bool FindRange(const SearchRange<T>& range) const override {
+        return FindRange(range.left, range.right);
+    }
+
+    bool GetHashTableSizeBits(size_t& size) const override {
+        size = 0;
+        for (const auto& level : levels_) {
+            size_t level_size = 0;
+            level.GetHashTableSizeBits(level_size);
+            size += level_size;
+        }
+        return true;
+    }
+
+    bool GetUsedSpaceBits(size_t& size) const override {
+        size = 0;
+        for (size_t h = 0; h < levels_.size(); ++h) {
+            size_t level_size = 0;
+            if (bits_per_prefix_[h] > 0) {
+                levels_[h].GetUsedSpaceBits(level_size);
+            }
+            size += level_size;
+        }
+        return true;
+    }
+
+private:
+    static const size_t kKeyBits = sizeof(T) * CHAR_BIT;
+
+    // Order-preserving map to unsigned values
+    static uint64_t ToUnsigned(T x) {
+        uint64_t result = static_cast<typename std::make_unsigned<T>::type>(x);
+        if (std::is_signed<T>::value) {
+            result ^= static_cast<uint64_t>(1) << (kKeyBits - 1);
+        }
+        return result;
+    }
+
+    // Bloom filters hash ints, wider prefixes are folded
+    static int PrefixKey(uint64_t prefix) {
+        return static_cast<int>(static_cast<uint32_t>(prefix ^ (prefix >> 32)));
+    }
+
+    static size_t HashFunctionsCount(size_t bits_per_prefix) {
+        return std::max<size_t>(std::round(bits_per_prefix * std::log(2.0)), 1);
+    }
+
+    // False positive rate of a Bloom filter with the given bits per item and the optimal number of hash functions
+    static double BloomFalsePositiveRate(size_t bits_per_prefix) {
+        if (bits_per_prefix == 0) {
+            return 1.0;
+        }
+        double functions = HashFunctionsCount(bits_per_prefix);
+        return std::pow(1.0 - std::exp(-functions / bits_per_prefix), functions);
+    }
+
+    // Empty range of the configured distribution with the keys found near its ends: bit h of left_filled is set
+    // if the interval of level h containing from has a key (outside of the range), the same for right_filled and to.
+    // The weight is the chance of a range of the distribution starting at from to be empty
+    struct SampleRange {
+        uint64_t from;
+        uint64_t to;
+        uint64_t left_filled;
+        uint64_t right_filled;
+        double weight;
+    };
+
+    static bool HasKey(const std::vector<uint64_t>& keys, uint64_t from, uint64_t to) {
+        auto it = std::lower_bound(keys.begin(), keys.end(), from);
+        return it != keys.end() && *it <= to;
+    }
+
+    // Range lengths are uniform up to max_range_length and starts are uniform between the smallest and the largest
+    // key. Only empty ranges can be false positives, so the length is drawn among the ones that fit before the next
+    // key, and the sample is weighted by the share of such lengths
+    std::vector<SampleRange> SampleEmptyRanges(const std::vector<uint64_t>& keys) const {
+        std::vector<SampleRange> ranges;
+        std::mt19937_64 rng(seed_);
+        std::uniform_int_distribution<uint64_t> start_distribution(keys.front(), keys.back());
+        for (size_t i = 0; i < kRosettaSampleRanges; ++i) {
+            uint64_t from = start_distribution(rng);
+            uint64_t room = std::min(*std::lower_bound(keys.begin(), keys.end(), from) - from, max_range_length_);
+            if (room == 0) {
+                continue;
+            }
+            uint64_t to = from + std::uniform_int_distribution<uint64_t>(0, room - 1)(rng);
+            SampleRange range{from, to, 0, 0, static_cast<double>(room) / max_range_length_};
+            for (size_t h = 0; h < levels_count_; ++h) {
+                uint64_t size = static_cast<uint64_t>(1) << h;
+                uint64_t left = from >> h << h;
+                uint64_t right = to >> h << h;
+                range.left_filled |= static_cast<uint64_t>(HasKey(keys, left, left + (size - 1))) << h;
+                range.right_filled |= static_cast<uint64_t>(HasKey(keys, right, right + (size - 1))) << h;
+            }
+            ranges.push_back(range);
+        }
+        return ranges;
+    }
+
+    // Expected false positive rate of FindRange over the sample. An interval inside the range is empty and passes
+    // with interval_rate[h]: its prefix passes and so does one of its halves. An interval that sticks out of the range
+    // passes its own level for sure if it has a key outside, and its halves are checked the same way
+    double ExpectedFalsePositiveRate(const std::vector<size_t>& bits_per_prefix, const std::vector<SampleRange>& ranges) const {
+        std::vector<double> level_rate(levels_count_);
+        std::vector<double> interval_rate(levels_count_);
+        for (size_t h = 0; h < levels_count_; ++h) {
+            level_rate[h] = BloomFalsePositiveRate(bits_per_prefix[h]);
+            double below = h == 0 ? 1.0 : 1.0 - (1.0 - interval_rate[h - 1]) * (1.0 - interval_rate[h - 1]);
+            interval_rate[h] = level_rate[h] * below;
+        }
+        size_t top = levels_count_ - 1;
+        double sum = 0.0;
+        double weights = 0.0;
+        for (const auto& range : ranges) {
+            double missed = 1.0;
+            for (uint64_t prefix = range.from >> top; prefix <= (range.to >> top); ++prefix) {
+                missed *= 1.0 - IntervalPassRate(prefix, top, range, level_rate, interval_rate);
+                if (prefix == (range.to >> top)) {
+                    break;
+                }
+            }
+            sum += range.weight * (1.0 - missed);
+            weights += range.weight;
+        }
+        return sum / weights;
+    }
+
+    // Mirrors FindInInterval for an empty range
+    double IntervalPassRate(uint64_t prefix, size_t h, const SampleRange& range,
+                            const std::vector<double>& level_rate, const std::vector<double>& interval_rate) const {
+        uint64_t begin = prefix << h;
+        uint64_t end = begin | ((static_cast<uint64_t>(1) << h) - 1);
+        if (end < range.from || begin > range.to) {
+            return 0.0;
+        }
+        if (begin >= range.from && end <= range.to) {
+            return interval_rate[h];
+        }
+        // Only intervals of levels above 0 stick out
+        uint64_t filled = begin <= range.from ? range.left_filled : range.right_filled;
+        double rate = (filled >> h) & 1 ? 1.0 : level_rate[h];
+        double left = IntervalPassRate(prefix << 1, h - 1, range, level_rate, interval_rate);
+        double right = IntervalPassRate((prefix << 1) | 1, h - 1, range, level_rate, interval_rate);
+        return rate * (1.0 - (1.0 - left) * (1.0 - right));
+    }
+
+    // Greedy split of the budget minimising the expected false positive rate over the sample. The first bits of
+    // a level gain little on their own (a one-bit Bloom filter passes most prefixes), so every step looks at adding
+    // up to kRosettaMaxStepBits bits to a level at once
+    std::vector<size_t> SplitBits(const std::vector<uint64_t>& keys, const std::vector<size_t>& prefixes_count,
+                                  double budget) const {
+        std::vector<size_t> bits_per_prefix(levels_count_, 0);
+        std::vector<SampleRange> ranges = SampleEmptyRanges(keys);
+        if (ranges.empty()) {
+            // Every range has keys, only point queries may be false positives
+            bits_per_prefix[0] = budget / prefixes_count[0];
+            return bits_per_prefix;
+        }
+        double current = ExpectedFalsePositiveRate(bits_per_prefix, ranges);
+        while (true) {
+            size_t best_level = levels_count_;
+            size_t best_bits = 0;
+            double best_gain = 0.0;
+            double best_value = current;
+            for (size_t h = 0; h < levels_count_; ++h) {
+                for (size_t bits = 1; bits <= kRosettaMaxStepBits && prefixes_count[h] > 0 &&
+                                      prefixes_count[h] * bits <= budget; ++bits) {
+                    bits_per_prefix[h] += bits;
+                    double value = ExpectedFalsePositiveRate(bits_per_prefix, ranges);
+                    bits_per_prefix[h] -= bits;
+                    double gain = (current - value) / (prefixes_count[h] * bits);
+                    if (gain > best_gain) {
+                        best_gain = gain;
+                        best_level = h;
+                        best_bits = bits;
+                        best_value = value;
+                    }
+                }
+            }
+            if (best_level == levels_count_) {
+                break;
+            }
+            bits_per_prefix[best_level] += best_bits;
+            budget -= prefixes_count[best_level] * best_bits;
+            current = best_value;
+        }
+        // The greedy steps settle on the levels they fill first, so bits are moved between levels while it helps
+        bool improved = true;
+        while (improved) {
+            improved = false;
+            for (size_t source = 0; source < levels_count_; ++source) {
+                for (size_t target = 0; target < levels_count_ && bits_per_prefix[source] > 0; ++target) {
+                    for (size_t bits = 1; bits <= kRosettaMaxStepBits && target != source; ++bits) {
+                        double left_budget = budget + prefixes_count[source] -
+                                             static_cast<double>(prefixes_count[target] * bits);
+                        if (left_budget < 0.0) {
+                            break;
+                        }
+                        --bits_per_prefix[source];
+                        bits_per_prefix[target] += bits;
+                        double value = ExpectedFalsePositiveRate(bits_per_prefix, ranges);
+                        if (value < current) {
+                            budget = left_budget;
+                            current = value;
+                            improved = true;
+                            break;
+                        }
+                        ++bits_per_prefix[source];
+                        bits_per_prefix[target] -= bits;
+                    }
+                }
+            }
+        }
+        return bits_per_prefix;
+    }
+
+    bool MayContain(uint64_t prefix, size_t h) const {
+        return bits_per_prefix_[h] == 0 || levels_[h].Find(PrefixKey(prefix));
+    }
+
+    // Interval of the prefix at level h intersected with [from, to]
+    bool FindInInterval(uint64_t prefix, size_t h, uint64_t from, uint64_t to) const {
+        uint64_t begin = prefix << h;
+        uint64_t end = begin | ((static_cast<uint64_t>(1) << h) - 1);
+        if (end < from || begin > to || !MayContain(prefix, h)) {
+            return false;
+        }
+        if (h == 0) {
+            return true;
+        }
+        return FindInInterval(prefix << 1, h - 1, from, to) || FindInInterval((prefix << 1) | 1, h - 1, from, to);
+    }
+
+    std::vector<BloomFilter<int>> levels_;
+    std::vector<size_t> bits_per_prefix_;
+    size_t keys_count_ = 0;
+    size_t point_level_ = 0;
+    size_t levels_count_ = 1;
+    uint64_t max_range_length_ = kDefaultRosettaMaxRangeLength;
+    double bits_per_key_ = kDefaultRosettaBitsPerKey;
+    uint32_t seed_ = 0;
+};
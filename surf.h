@@ -1,12 +1,24 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <exception>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 
 #include "bitvector.h"
 #include "compressed_vector.h"
 #include "consts.h"
 #include "filter.h"
+#include "hash.h"
+#include "hope.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 bool HaveCommonPrefixes(const std::string& a, const std::string& b, size_t pos) {
     if (a.size() <= pos || b.size() <= pos) {
@@ -39,35 +51,105 @@ size_t CommonPrefixLength(const std::string& a, const std::string& b) {
     return count;
 }
 
+// Calls f(begin, end) for threads consecutive parts of [0, count), each part in its own thread
+template <class Function>
+void ParallelChunks(size_t count, size_t threads, Function f) {
+    threads = std::max<size_t>(std::min(threads, count), 1);
+    if (threads == 1) {
+        f(0, count);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back(f, count * t / threads, count * (t + 1) / threads);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Sorts the parts concurrently, then merges pairs of neighbouring parts concurrently
+template <class T>
+void ParallelSort(std::vector<T>& values, size_t threads) {
+    size_t parts = std::max<size_t>(std::min(threads, values.size()), 1);
+    auto bound = [&](size_t part) {
+        return values.begin() + values.size() * std::min(part, parts) / parts;
+    };
+    ParallelChunks(parts, parts, [&](size_t part, size_t) {
+        std::sort(bound(part), bound(part + 1));
+    });
+    for (size_t width = 1; width < parts; width *= 2) {
+        size_t merges = (parts + 2 * width - 1) / (2 * width);
+        ParallelChunks(merges, merges, [&](size_t merge, size_t) {
+            size_t first = merge * 2 * width;
+            std::inplace_merge(bound(first), bound(first + width), bound(first + 2 * width));
+        });
+    }
+}
+
 enum class SuffixType {
     Empty = 0,
     Hash = 1,
-    Real = 2
+    Real = 2,
+    Mixed = 3  // real suffix followed by hash suffix
+};
+
+// Query key with its hash computed on first use, so a query hashes the key at most once
+class HashedKey {
+public:
+    explicit HashedKey(std::string_view key) : key_(key), hash_(0), hashed_(false) {
+    }
+
+    std::string_view Key() const {
+        return key_;
+    }
+
+    uint64_t Hash() {
+        if (!hashed_) {
+            hash_ = StringHash(key_);
+            hashed_ = true;
+        }
+        return hash_;
+    }
+
+private:
+    std::string_view key_;
+    uint64_t hash_;
+    bool hashed_;
 };
 
+// Suffix bits kept for every leaf. The real suffix is real_size_ bits of the key after the leaf label:
+// whole bytes in real_bytes_ and the high bits of the next byte in real_tail_, bytes past the key end are zeros.
+// The hash suffix is hash_size_ low bits of StringHash of the key. Real bits filter both point and range queries,
+// hash bits filter point queries only, and are cheaper for them.
 class SuffixVector {
 public:
     SuffixVector() = default;
 
-    SuffixVector(SuffixType type, size_t capacity, size_t item_size, bool use_any)
-        : data_(capacity, item_size), hash_(), item_size_(item_size), size_(0), type_(type), use_any_(use_any) {}
+    SuffixVector(size_t capacity, size_t real_size, size_t hash_size, bool use_any)
+        : real_bytes_(), real_tail_(), hashes_(), real_size_(real_size), hash_size_(hash_size), size_(0), use_any_(use_any) {
+        if (RealBytes() > 0) {
+            real_bytes_ = CompressedVector<uint8_t, CHAR_BIT>(capacity * RealBytes());
+        }
+        if (RealTailBits() > 0) {
+            real_tail_ = CompressedVector<uint32_t>(capacity, RealTailBits());
+        }
+        if (hash_size_ > 0) {
+            hashes_ = CompressedVector<uint32_t>(capacity, hash_size_);
+        }
+    }
 
-    void AddSuffix(const std::string& s, size_t pos) {
-        if (type_ == SuffixType::Empty) {
-            return;
+    // hash is StringHash(s), it is used only if there is a hash suffix
+    void AddSuffix(std::string_view s, size_t pos, uint64_t hash) {
+        for (size_t j = 0; j < RealBytes(); ++j) {
+            real_bytes_.SetValueByIndex(size_ * RealBytes() + j, KeyByte(s, pos + 1 + j));
         }
-        uint32_t value = 0;
-        if (type_ == SuffixType::Real) {
-            if (pos + 1 < s.size()) {
-                value = ToUint32(s[pos + 1], item_size_);
-            } else {
-                value = ToUint32(kTerminator, item_size_);
-            }
+        if (RealTailBits() > 0) {
+            real_tail_.SetValueByIndex(size_, KeyByte(s, pos + 1 + RealBytes()) >> (CHAR_BIT - RealTailBits()));
         }
-        if (type_ == SuffixType::Hash) {
-            value = hash_(s) % (1 << item_size_);
+        if (hash_size_ > 0) {
+            hashes_.SetValueByIndex(size_, HashBits(hash));
         }
-        data_.SetValueByIndex(size_, value);
         ++size_;
     };
 
@@ -75,77 +157,130 @@ public:
         if (!use_any_) {
             throw "Add any suffix without use_any";
         }
-        if (type_ == SuffixType::Empty) {
-            return;
+        for (size_t j = 0; j < RealBytes(); ++j) {
+            real_bytes_.SetValueByIndex(size_ * RealBytes() + j, j == 0 ? AnyByte() : 0);
+        }
+        if (RealTailBits() > 0) {
+            real_tail_.SetValueByIndex(size_, RealBytes() == 0 ? AnyByte() >> (CHAR_BIT - RealTailBits()) : 0);
+        }
+        if (hash_size_ > 0) {
+            hashes_.SetValueByIndex(size_, AnyHash());
         }
-        uint32_t value = ToUint32(kAnyChar, item_size_);
-        data_.SetValueByIndex(size_, value);
         ++size_;
     }
 
-    bool MatchSuffix(const std::string& s, size_t pos, size_t index) const {
-        if (type_ == SuffixType::Empty) {
+    // Checks the key which has its leaf label at pos. The key is hashed only if the real bits match
+    bool MatchSuffix(HashedKey& key, size_t pos, size_t index) const {
+        if (IsAny(index)) {
             return true;
         }
-        if (type_ == SuffixType::Real) {
-            uint32_t next_symbol = 0;
-            uint32_t found_symbol = data_.GetValueByIndex(index);
-            if (use_any_ && found_symbol == ToUint32(kAnyChar, item_size_)) {
-                return true;
-            }
+        return CompareRealSuffix(key.Key(), pos, index) == 0 && (hash_size_ == 0 || hashes_.GetValueByIndex(index) == HashBits(key.Hash()));
+    }
 
-            if (pos + 1 < s.size()) {
-                next_symbol = ToUint32(s[pos + 1], item_size_);
-            } else {
-                next_symbol = ToUint32(kTerminator, item_size_);
+    bool HasHashSuffix() const {
+        return hash_size_ > 0;
+    }
+
+    // Checks the prefix s of a key: only the real bits covered by s are compared
+    bool MatchPrefix(std::string_view s, size_t pos, size_t index) const {
+        return IsAny(index) || CompareRealSuffix(s, pos, index, true) == 0;
+    }
+
+    // Compares the real suffix bits of s after pos with the stored ones, as strings are compared.
+    // Bytes past the end of s are zeros, or are not compared if only_present is set.
+    int CompareRealSuffix(std::string_view s, size_t pos, size_t index, bool only_present = false) const {
+        for (size_t j = 0; j < RealBytes(); ++j) {
+            if (only_present && pos + 1 + j >= s.size()) {
+                return 0;
+            }
+            uint32_t x = KeyByte(s, pos + 1 + j);
+            uint32_t y = real_bytes_.GetValueByIndex(index * RealBytes() + j);
+            if (x != y) {
+                return x < y ? -1 : 1;
             }
-            return found_symbol == next_symbol;
         }
-        if (type_ == SuffixType::Hash) {
-            if (use_any_ && ToUint32(kAnyChar, item_size_) == data_.GetValueByIndex(index)) {
-                return true;
+        if (RealTailBits() > 0 && !(only_present && pos + 1 + RealBytes() >= s.size())) {
+            uint32_t x = KeyByte(s, pos + 1 + RealBytes()) >> (CHAR_BIT - RealTailBits());
+            uint32_t y = real_tail_.GetValueByIndex(index);
+            if (x != y) {
+                return x < y ? -1 : 1;
             }
-            return hash_(s) % (1 << item_size_) == data_.GetValueByIndex(index);
         }
-        return true;
+        return 0;
     }
 
-    char GetSuffix(size_t index) const {
-        if (type_ != SuffixType::Real) {
-            throw "Call GetSuffix for SuffixVector without real suffix";
+    bool IsAny(size_t index) const {
+        if (!use_any_) {
+            return false;
+        }
+        for (size_t j = 0; j < RealBytes(); ++j) {
+            if (real_bytes_.GetValueByIndex(index * RealBytes() + j) != (j == 0 ? AnyByte() : 0)) {
+                return false;
+            }
         }
-        return FromUint32(data_.GetValueByIndex(index));
+        if (RealTailBits() > 0 && real_tail_.GetValueByIndex(index) != (RealBytes() == 0 ? AnyByte() >> (CHAR_BIT - RealTailBits()) : 0)) {
+            return false;
+        }
+        return hash_size_ == 0 || hashes_.GetValueByIndex(index) == AnyHash();
     }
 
-    char GetAny() const {
-        return FromUint32(ToUint32(kAnyChar, item_size_));
+    // Number of real suffix bytes restored for the leaf. Trailing zero bytes are dropped:
+    // they may be past the key end, and the key without them is still not greater than the stored one
+    size_t RealSuffixLength(size_t index) const {
+        if (IsAny(index)) {
+            return 0;
+        }
+        size_t length = RealBytes() + (RealTailBits() > 0 ? 1 : 0);
+        while (length > 0 && GetRealSuffixByte(index, length - 1) == kTerminator) {
+            --length;
+        }
+        return length;
+    }
+
+    // Byte j of the real suffix, the last byte has its low bits zeroed if real_size_ is not a whole number of bytes
+    char GetRealSuffixByte(size_t index, size_t j) const {
+        if (j < RealBytes()) {
+            return static_cast<char>(real_bytes_.GetValueByIndex(index * RealBytes() + j));
+        }
+        return static_cast<char>(real_tail_.GetValueByIndex(index) << (CHAR_BIT - RealTailBits()));
     }
 
     size_t DataSizeBits() const {
-        return data_.BitsSize();
+        return real_bytes_.BitsSize() + real_tail_.BitsSize() + hashes_.BitsSize();
     }
 
 private:
+    size_t RealBytes() const {
+        return real_size_ / CHAR_BIT;
+    }
 
-    uint32_t ToUint32(char c, size_t bits = kMaxRealSuffixSize) const {
-        uint32_t result = 0;
-        char* ptr = (char*)(&result);
-        ptr[0] = c;
-        result >>= kMaxRealSuffixSize - bits;
-        return result;
+    size_t RealTailBits() const {
+        return real_size_ % CHAR_BIT;
     }
 
-    char FromUint32(uint32_t x) const {
-        x <<= kMaxRealSuffixSize - item_size_;
-        return ((char*)(&x))[0];
+    static uint32_t KeyByte(std::string_view s, size_t i) {
+        return static_cast<unsigned char>(i < s.size() ? s[i] : kTerminator);
     }
 
-    CompressedVector<uint32_t> data_;
-    std::hash<std::string> hash_;
-    size_t item_size_;
-    size_t size_;
-    SuffixType type_;
-    bool use_any_;
+    static uint32_t AnyByte() {
+        return static_cast<unsigned char>(kAnyChar);
+    }
+
+    uint32_t AnyHash() const {
+        return static_cast<uint32_t>(1) << (hash_size_ - 1);
+    }
+
+    uint32_t HashBits(uint64_t hash) const {
+        return hash & ((static_cast<uint64_t>(1) << hash_size_) - 1);
+    }
+
+    CompressedVector<uint8_t, CHAR_BIT> real_bytes_;
+    CompressedVector<uint32_t> real_tail_;
+    CompressedVector<uint32_t> hashes_;
+    size_t real_size_ = 0;
+    size_t hash_size_ = 0;
+    size_t size_ = 0;
+    bool use_any_ = false;
 };
 
 class FastSuccinctTrie {
@@ -153,105 +288,179 @@ public:
     FastSuccinctTrie() {
     }
 
-    void Init(SuffixType suf_type, size_t suffix_size = kDefaultSurfSuffixSize) {
+    // suffix_size is the size of the real or hash suffix, for SuffixType::Mixed it is the size of the real one
+    void Init(SuffixType suf_type, size_t suffix_size = kDefaultSurfSuffixSize,
+              size_t sparse_dense_ratio = kSurfSparseDenseRatio, size_t hash_suffix_size = kDefaultSurfSuffixSize) {
         suffix_type_ = suf_type;
-        if (suffix_type_ == SuffixType::Empty) {
-            suffix_size_ = 0;
-        } else {
-            suffix_size_ = suffix_size;
+        sparse_dense_ratio_ = sparse_dense_ratio;
+        real_suffix_size_ = 0;
+        hash_suffix_size_ = 0;
+        if (suffix_type_ == SuffixType::Real || suffix_type_ == SuffixType::Mixed) {
+            real_suffix_size_ = suffix_size;
+        }
+        if (suffix_type_ == SuffixType::Hash) {
+            hash_suffix_size_ = suffix_size;
+        } else if (suffix_type_ == SuffixType::Mixed) {
+            hash_suffix_size_ = hash_suffix_size;
         }
     }
 
-    void Build(const std::vector<std::string>& values, bool use_terminator = true, int fixed_length = -1, bool use_any = false) {
+    // Sparse labels are stored with as few bits as the alphabet of the labels needs
+    void SetReducedLabels(bool reduce_labels) {
+        reduce_labels_ = reduce_labels;
+    }
+
+    // values must be sorted and distinct. Every key is visited once: with the LCP of the neighbours known,
+    // a key adds its labels to the levels from its LCP with the previous key down to its leaf,
+    // and each level is collected in its own buffers, which are concatenated in BFS order at the end.
+    // With threads > 1 the keys are split into ranges whose levels are collected concurrently:
+    // labels shared with the previous range belong to it, so the levels of the ranges are just concatenated.
+    void Build(const std::vector<std::string>& values, bool use_terminator = true, int fixed_length = -1, bool use_any = false,
+               size_t threads = 1) {
         use_terminator_ = use_terminator;
         fixed_length_ = fixed_length;
         use_any_ = use_any;
 
-        std::vector<bool> done(values.size(), false);
-        s_values_ = SuffixVector(suffix_type_, values.size(), suffix_size_, use_any_);
+        std::vector<size_t> common_prefixes(values.size() + 1, 0);
+        ParallelChunks(values.size(), threads, [&](size_t begin, size_t end) {
+            for (size_t i = std::max<size_t>(begin, 1); i < end; ++i) {
+                common_prefixes[i] = CommonPrefixLength(values[i - 1], values[i]);
+            }
+        });
 
-        std::vector<bool> s_has_child;
-        std::vector<bool> s_louds;
+        std::vector<Level> levels;
+        if (threads <= 1) {
+            AddLevelLabels(values, common_prefixes, 0, values.size(), levels);
+        } else {
+            std::vector<std::vector<Level>> parts(std::min(threads, std::max<size_t>(values.size(), 1)));
+            ParallelChunks(parts.size(), parts.size(), [&](size_t part, size_t) {
+                AddLevelLabels(values, common_prefixes, values.size() * part / parts.size(),
+                               values.size() * (part + 1) / parts.size(), parts[part]);
+            });
+            levels = ConcatenateLevels(parts, threads);
+        }
 
-        size_t idx = 0;
-        bool updated = true;
-        while (updated) {
-            updated = false;
-            for (size_t i = 0; i < values.size(); ++i) {
-                if (done[i]) {
-                    continue;
+        s_values_ = SuffixVector(values.size(), real_suffix_size_, hash_suffix_size_, use_any_);
+        // Keys are hashed in one pass in key order, suffixes are then added in leaf order
+        std::vector<uint64_t> hashes;
+        if (s_values_.HasHashSuffix()) {
+            hashes.resize(values.size());
+            ParallelChunks(values.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    hashes[i] = StringHash(values[i]);
                 }
+            });
+        }
 
-                if (idx < values[i].size()) {
-                    updated = true;
+        BuildAlphabet(levels);
+        size_t dense_levels = CountDenseLevels(levels);
+        BuildDenseLevels(levels, dense_levels, values, hashes);
+        BuildSparseLevels(levels, dense_levels, values, hashes);
 
-                    if (i == 0 || !HaveCommonPrefixes(values[i - 1], values[i], idx)) {
-                        s_labels_.push_back(values[i][idx]);
-                        s_has_child.push_back(false);
-                        s_louds.push_back(i == 0 || !(idx == 0 || HaveCommonPrefixes(values[i - 1], values[i], idx - 1)));
-                        if (i == values.size() - 1 || !HaveCommonPrefixes(values[i], values[i + 1], idx)) {
-                            s_values_.AddSuffix(values[i], idx);
-                            done[i] = true;
-                        }
-                    }
-                    if (!done[i]) {
-                        if (idx + 1 < values[i].size()) {
-                            if (use_any && idx == fixed_length_) {
-                                if (i + 1 == values.size() || !HaveCommonPrefixes(values[i], values[i + 1], idx)) {
-                                    s_values_.AddAnySuffix();
-                                }
-                                done[i] = true;
-                                continue;
-                            }
-                            s_has_child[s_has_child.size() - 1] = true;
-                        } else {
-                            s_values_.AddSuffix(values[i], idx);
-                            done[i] = true;
-                        }
-                    }
-                }
+        // DebugPrint();
+    }
+
+    // Positions matched by the previous query. Queries given in sorted order share prefixes,
+    // so the walk resumes from the deepest position shared with the previous query.
+    class QueryPath {
+    public:
+        QueryPath() : key_(), steps_() {
+        }
+
+    private:
+        friend class FastSuccinctTrie;
+
+        struct Step {
+            int pos;
+            // The deepest next sibling among the positions up to this one, used by range queries
+            int fallback;
+            size_t fallback_depth;
+            // Depth after the label of pos and its path, the path labels repeat the step
+            size_t end;
+        };
+
+        // Returns the number of steps kept for the next query
+        size_t Resume(std::string_view key) {
+            size_t depth = 0;
+            size_t limit = std::min(steps_.size(), key.size());
+            while (depth < limit && key_[depth] == key[depth]) {
+                ++depth;
             }
-            ++idx;
+            // A path matched in part is matched again
+            while (depth > 0 && steps_[depth - 1].end != depth) {
+                --depth;
+            }
+            steps_.resize(depth);
+            key_.assign(key.data(), key.size());
+            return depth;
         }
 
-        s_has_child_.Init(s_has_child);
-        s_louds_.Init(s_louds);
+        std::string key_;
+        // steps_[d] matches key_[d] and has children
+        std::vector<Step> steps_;
+    };
 
-        // DebugPrint();
+    bool Find(std::string_view key, QueryPath* path = nullptr) const {
+        HashedKey hashed_key(key);
+        return Find(hashed_key, path);
     }
 
-    bool Find(const std::string& key) const {
-        int pos = -1;
-        int idx = 0;
-        for (const auto& c : key) {
-            pos = Go(pos, c);
+    // The key is hashed once, only if the hash suffix of its leaf is checked
+    bool Find(HashedKey& hashed_key, QueryPath* path = nullptr) const {
+        std::string_view key = hashed_key.Key();
+        size_t idx = path != nullptr ? path->Resume(key) : 0;
+        int pos = idx == 0 ? -1 : path->steps_[idx - 1].pos;
+        for (; idx < key.size(); ++idx) {
+            pos = Go(pos, key[idx]);
             if (pos == -1) {
                 return false;
             }
-            if (!s_has_child_[pos]) {
-                return s_values_.MatchSuffix(key, idx, pos - s_has_child_.Rank(pos));
+            if (!HasChild(pos)) {
+                return s_values_.MatchSuffix(hashed_key, idx, LeafIndex(pos));
+            }
+            std::string_view label_path = GetPath(pos);
+            if (!label_path.empty()) {
+                size_t length = std::min(label_path.size(), key.size() - idx - 1);
+                if (std::memcmp(label_path.data(), key.data() + idx + 1, length) != 0) {
+                    return false;
+                }
+                if (length < label_path.size()) {
+                    // The key ends inside the path. A terminator is a leaf and never gets into a path, but without
+                    // terminators a 0 byte label with a child does, and Go(pos, kTerminator) below would match it
+                    return label_path[length] == kTerminator;
+                }
+            }
+            size_t end = idx + 1 + label_path.size();
+            if (path != nullptr) {
+                for (; idx < end; ++idx) {
+                    path->steps_.push_back({pos, -1, 0, end});
+                }
             }
-            ++idx;
+            idx = end - 1;
         }
-        if (pos != -1 && !s_has_child_[pos]) {
+        if (pos != -1 && !HasChild(pos)) {
             return true;
         }
         pos = Go(pos, kTerminator);
         return pos != -1;
     }
 
-    bool FindPrefix(const std::string& prefix) const {
+    bool FindPrefix(std::string_view prefix) const {
         int pos = -1;
-        int idx = 0;
-        for (const auto& c : prefix) {
-            if (pos != -1 && !s_has_child_[pos]) {
-                return suffix_type_ != SuffixType::Real || s_values_.MatchSuffix(prefix, idx - 1, pos - s_has_child_.Rank(pos));
+        for (size_t idx = 0; idx < prefix.size(); ++idx) {
+            if (pos != -1 && !HasChild(pos)) {
+                return s_values_.MatchPrefix(prefix, idx - 1, LeafIndex(pos));
             }
-            pos = Go(pos, c);
+            pos = Go(pos, prefix[idx]);
             if (pos == -1) {
                 return false;
             }
-            ++idx;
+            std::string_view label_path = GetPath(pos);
+            size_t length = std::min(label_path.size(), prefix.size() - idx - 1);
+            if (length > 0 && std::memcmp(label_path.data(), prefix.data() + idx + 1, length) != 0) {
+                return false;
+            }
+            idx += length;
         }
         if (pos != -1) {
             return true;
@@ -259,42 +468,250 @@ public:
         return false;
     }
 
-    std::string LowerBound(const std::string& key) const {
-        int pos = -1;
-        for (const auto& c : key) {
-            if (pos != -1 && !s_has_child_[pos]) {
-                if (suffix_type_ != SuffixType::Real) {
-                    break;
+    // Walks the keys in order. Keeps the path from the root to the current leaf,
+    // so stepping to a neighbouring key only touches the levels below the common ancestor.
+    // Keys are restored as in the trie: truncated to the stored prefix and real suffix bits.
+    class Iterator {
+    public:
+        explicit Iterator(const FastSuccinctTrie* trie) : trie_(trie), path_() {
+        }
+
+        bool Valid() const {
+            return !path_.empty();
+        }
+
+        // Moves to the first key not less than key
+        void Seek(std::string_view key) {
+            path_.clear();
+            int pos = -1;
+            for (size_t depth = 0; depth < key.size(); ++depth) {
+                char c = key[depth];
+                if (pos != -1 && !trie_->HasChild(pos)) {
+                    // The key continues with the real suffix, it is less than key only if the suffix is
+                    size_t leaf = trie_->LeafIndex(pos);
+                    if (!trie_->s_values_.IsAny(leaf) && trie_->s_values_.CompareRealSuffix(key, depth - 1, leaf) > 0) {
+                        Next();
+                    }
+                    return;
                 }
-                auto suf = s_values_.GetSuffix(pos - s_has_child_.Rank(pos));
-                auto max_suf = suf | ((1 << (kMaxRealSuffixSize - suffix_size_)) - 1); // c can be in range [suf, max_suf] if it fits
 
-                if (use_any_ && suf == s_values_.GetAny()) {
-                    break;
+                int new_pos = trie_->Go(pos, c, true);
+                if (new_pos == -1) {
+                    if (pos != -1) {
+                        Next();
+                    }
+                    return;
                 }
-                if ((c >= 0 && max_suf >= 0 && c > max_suf) || (c < 0 && (max_suf >= 0 || (max_suf < 0 && c > max_suf)))) {
-                    pos = MoveToNext(pos);
+                path_.push_back(new_pos);
+                if (trie_->GetLabel(new_pos) != c) {
+                    DescendToFirst();
+                    return;
                 }
-                break;
+                std::string_view label_path = trie_->GetPath(new_pos);
+                int cmp = ComparePath(label_path, key, depth + 1);
+                if (cmp > 0) {
+                    DescendToFirst();
+                    return;
+                }
+                if (cmp < 0) {
+                    Next();
+                    return;
+                }
+                depth += label_path.size();
+                pos = new_pos;
+            }
+            // key is a prefix of the trie keys, the first of them is the answer
+            if (path_.empty()) {
+                SeekToFirst();
+                return;
+            }
+            DescendToFirst();
+        }
+
+        void SeekToFirst() {
+            path_.clear();
+            int pos = trie_->MoveToChildren(-1);
+            if (pos != -1 && pos < trie_->dense_size_ + static_cast<int>(trie_->s_louds_.Size())) {
+                path_.push_back(pos);
+                DescendToFirst();
+            }
+        }
+
+        void Next() {
+            while (!path_.empty()) {
+                int next = trie_->NextSibling(path_.back());
+                if (next != -1) {
+                    path_.back() = next;
+                    DescendToFirst();
+                    return;
+                }
+                path_.pop_back();
+            }
+        }
+
+        void Prev() {
+            while (!path_.empty()) {
+                int prev = trie_->PrevSibling(path_.back());
+                if (prev != -1) {
+                    path_.back() = prev;
+                    DescendToLast();
+                    return;
+                }
+                path_.pop_back();
+            }
+        }
+
+        std::string Key() const {
+            std::string result;
+            auto push_label = [&](char label) {
+                if (label != kTerminator || !trie_->use_terminator_) {
+                    result += label;
+                }
+            };
+            for (const auto pos : path_) {
+                push_label(trie_->GetLabel(pos));
+                for (const auto label : trie_->GetPath(pos)) {
+                    push_label(label);
+                }
+            }
+            int leaf = path_.back();
+            if (!trie_->HasChild(leaf)) {
+                size_t index = trie_->LeafIndex(leaf);
+                size_t length = trie_->s_values_.RealSuffixLength(index);
+                for (size_t j = 0; j < length; ++j) {
+                    result += trie_->s_values_.GetRealSuffixByte(index, j);
+                }
+            }
+            if (trie_->fixed_length_ != -1) {
+                if (!trie_->use_any_ || (result.size() > static_cast<size_t>(trie_->fixed_length_))) {
+                    result.resize(trie_->fixed_length_);
+                }
+            }
+            return result;
+        }
+
+    private:
+        void DescendToFirst() {
+            while (trie_->HasChild(path_.back())) {
+                path_.push_back(trie_->MoveToChildren(path_.back()));
+            }
+        }
+
+        void DescendToLast() {
+            while (trie_->HasChild(path_.back())) {
+                path_.push_back(trie_->MoveToLastChild(path_.back()));
+            }
+        }
+
+        const FastSuccinctTrie* trie_;
+        std::vector<int> path_;
+    };
+
+    Iterator GetIterator() const {
+        return Iterator(this);
+    }
+
+    std::string LowerBound(std::string_view key) const {
+        Iterator it(this);
+        it.Seek(key);
+        return it.Valid() ? it.Key() : "";
+    }
+
+    // Checks if some key is in [left, right]: finds the first key not less than left like Iterator::Seek,
+    // but compares its restored form with right while walking, without keeping the path or the key
+    bool RangeNonEmpty(std::string_view left, std::string_view right, QueryPath* path = nullptr) const {
+        size_t depth = path != nullptr ? path->Resume(left) : 0;
+        int pos = -1;
+        // The deepest position of the path with a next sibling, the place where Next would go
+        int fallback = -1;
+        size_t fallback_depth = 0;
+        if (depth > 0) {
+            const auto& step = path->steps_[depth - 1];
+            pos = step.pos;
+            fallback = step.fallback;
+            fallback_depth = step.fallback_depth;
+        }
+        for (; depth < left.size(); ++depth) {
+            char c = left[depth];
+            if (pos != -1 && !HasChild(pos)) {
+                size_t leaf = LeafIndex(pos);
+                if (!s_values_.IsAny(leaf) && s_values_.CompareRealSuffix(left, depth - 1, leaf) > 0) {
+                    break;
+                }
+                return RestoredNotGreater(left, depth, pos, false, right);
             }
 
             int new_pos = Go(pos, c, true);
             if (new_pos == -1) {
-                pos = MoveToNext(pos);
                 break;
-            } else if (s_labels_[new_pos] != c) {
-                pos = MoveToNext(new_pos, true);
+            }
+            if (GetLabel(new_pos) != c) {
+                return RestoredNotGreater(left, depth, new_pos, true, right);
+            }
+            int next = NextSibling(new_pos);
+            if (next != -1) {
+                fallback = next;
+                fallback_depth = depth;
+            }
+            std::string_view label_path = GetPath(new_pos);
+            int cmp = ComparePath(label_path, left, depth + 1);
+            if (cmp > 0) {
+                return RestoredNotGreater(left, depth, new_pos, true, right);
+            }
+            if (cmp < 0) {
                 break;
             }
             pos = new_pos;
+            size_t end = depth + 1 + label_path.size();
+            if (!HasChild(pos)) {
+                if (depth + 1 == left.size()) {
+                    return RestoredNotGreater(left, left.size(), pos, false, right);
+                }
+            } else if (path != nullptr) {
+                for (size_t d = depth; d < end; ++d) {
+                    path->steps_.push_back({pos, fallback, fallback_depth, end});
+                }
+            }
+            depth = end - 1;
+        }
+        if (depth == left.size()) {
+            // left is a prefix of the keys under pos, the first of them is the answer
+            int first = MoveToChildren(pos);
+            return first != -1 && (pos != -1 || first < dense_size_ + static_cast<int>(s_louds_.Size())) &&
+                   RestoredNotGreater(left, left.size(), first, true, right);
         }
+        return fallback != -1 && RestoredNotGreater(left, fallback_depth, fallback, true, right);
+    }
 
-        return RestoreString(pos);
+    // Estimated number of keys in [left, right]. In BFS order the labels of every level are sorted by key,
+    // so the labels before a bound form a prefix of each level: the bound is found by the walk down the trie
+    // while the key matches, and below that the prefix of the next level is given by the children of the labels
+    // in the current one. The answer is the number of leaves between the bounds summed over the levels.
+    // It is exact up to the keys of leaves whose stored prefix and real suffix can't be told from a bound
+    size_t ApproxCount(std::string_view left, std::string_view right) const {
+        int end = dense_size_ + static_cast<int>(s_louds_.Size());
+        if (end == 0 || right < left) {
+            return 0;
+        }
+        BoundCuts lower(this, left, false);
+        BoundCuts upper(this, right, true);
+        int64_t count = 0;
+        while (true) {
+            int from = lower.Next();
+            int to = upper.Next();
+            count += static_cast<int64_t>(LeavesBefore(to)) - static_cast<int64_t>(LeavesBefore(from));
+            if ((from == to && !lower.Walking() && !upper.Walking()) || (from == end && to == end)) {
+                break;
+            }
+        }
+        return std::max<int64_t>(count, 0);
     }
 
     size_t CalculateSize() const {
-        size_t size = s_labels_.size() * CHAR_BIT;
-        size += s_has_child_.Size() + s_louds_.Size();
+        size_t size = s_labels_.size() * CHAR_BIT + s_label_codes_.BitsSize() + alphabet_.size() * CHAR_BIT;
+        size += s_has_child_.BitsSize() + s_louds_.BitsSize();
+        size += d_labels_.BitsSize() + d_has_child_.BitsSize();
+        size += s_has_path_.BitsSize() + s_path_labels_.size() * CHAR_BIT + s_path_ends_.BitsSize();
         size += s_values_.DataSizeBits();
         return size;
     }
@@ -319,131 +736,823 @@ public:
     }
 
 private:
+    // Positions: [0, dense_size_) are in the dense levels, position node * kDenseFanout + label
+    // refers to the label of the node. Positions from dense_size_ are in the sparse levels,
+    // shifted by dense_size_. Nodes are numbered in BFS order, so node k is the child of
+    // the k-th label with a child.
+    static const int kDenseFanout = 1 << CHAR_BIT;
+    // Sparse labels compared at once by FindChild
+    static const size_t kLabelsChunk = 16;
+    static const uint32_t kLabelsChunkMask = (1u << kLabelsChunk) - 1;
+
+    // Labels of one trie level in BFS order, and the keys whose suffixes are stored at the level
+    struct Level {
+        std::vector<char> labels;
+        BitVectorBuilder has_child;
+        BitVectorBuilder louds;
+        size_t nodes_count = 0;
+        std::vector<uint32_t> suffixes;
+    };
+
+    static constexpr uint32_t kAnySuffix = UINT32_MAX;
+
+    // Adds the labels of keys [begin, end) to levels
+    void AddLevelLabels(const std::vector<std::string>& values, const std::vector<size_t>& common_prefixes,
+                        size_t begin, size_t end, std::vector<Level>& levels) const {
+        // Only compared if use_any_ is set, then fixed_length_ > 0
+        const size_t any_level = static_cast<size_t>(fixed_length_);
+        for (size_t i = begin; i < end; ++i) {
+            const std::string& value = values[i];
+            // The key shares the labels of levels [0, prev) with the previous key
+            // and the label of levels [0, next) with the next one
+            size_t prev = common_prefixes[i];
+            size_t next = common_prefixes[i + 1];
+            for (size_t idx = 0; idx < value.size(); ++idx) {
+                if (levels.size() <= idx) {
+                    levels.emplace_back();
+                }
+                Level& level = levels[idx];
+                if (idx >= prev) {
+                    level.labels.push_back(value[idx]);
+                    level.has_child.PushBack(false);
+                    bool node_start = i == 0 || (idx > 0 && prev < idx);
+                    level.louds.PushBack(node_start);
+                    level.nodes_count += node_start;
+                    if (idx >= next) {
+                        level.suffixes.push_back(i);
+                        break;
+                    }
+                }
+                if (idx + 1 < value.size()) {
+                    if (use_any_ && idx == any_level) {
+                        if (idx >= next) {
+                            level.suffixes.push_back(kAnySuffix);
+                        }
+                        break;
+                    }
+                    // The label may be pushed by the previous range of keys, it has a child already
+                    if (level.has_child.Size() > 0) {
+                        level.has_child.SetBack(true);
+                    }
+                } else {
+                    level.suffixes.push_back(i);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Levels of consecutive key ranges joined level by level, different levels are joined concurrently
+    static std::vector<Level> ConcatenateLevels(std::vector<std::vector<Level>>& parts, size_t threads) {
+        size_t levels_count = 0;
+        for (const auto& part : parts) {
+            levels_count = std::max(levels_count, part.size());
+        }
+        std::vector<Level> levels(levels_count);
+        ParallelChunks(levels_count, threads, [&](size_t begin, size_t end) {
+            for (size_t idx = begin; idx < end; ++idx) {
+                Level& level = levels[idx];
+                for (auto& part : parts) {
+                    if (idx >= part.size()) {
+                        continue;
+                    }
+                    Level& part_level = part[idx];
+                    level.labels.insert(level.labels.end(), part_level.labels.begin(), part_level.labels.end());
+                    level.has_child.Append(part_level.has_child.Build());
+                    level.louds.Append(part_level.louds.Build());
+                    level.nodes_count += part_level.nodes_count;
+                    level.suffixes.insert(level.suffixes.end(), part_level.suffixes.begin(), part_level.suffixes.end());
+                    part_level = Level();
+                }
+            }
+        });
+        return levels;
+    }
+
+    // SuRF rule: the top levels are dense while their size multiplied by the ratio
+    // doesn't exceed the size of the remaining sparse levels
+    size_t CountDenseLevels(const std::vector<Level>& levels) const {
+        const size_t kSparseLabelBits = (alphabet_.empty() ? CHAR_BIT : label_bits_) + 2;
+        const size_t kDenseNodeBits = 2 * kDenseFanout;
+        size_t sparse_bits = 0;
+        for (const auto& level : levels) {
+            sparse_bits += level.labels.size() * kSparseLabelBits;
+        }
+        size_t dense_bits = 0;
+        size_t dense_levels = 0;
+        for (; dense_levels < levels.size(); ++dense_levels) {
+            const Level& level = levels[dense_levels];
+            size_t level_nodes = level.nodes_count;
+            if ((dense_bits + level_nodes * kDenseNodeBits) * sparse_dense_ratio_ > sparse_bits - level.labels.size() * kSparseLabelBits) {
+                break;
+            }
+            dense_bits += level_nodes * kDenseNodeBits;
+            sparse_bits -= level.labels.size() * kSparseLabelBits;
+        }
+        return dense_levels;
+    }
+
+    void AddSuffix(const std::vector<std::string>& values, const std::vector<uint64_t>& hashes, uint32_t i, size_t depth) {
+        if (i == kAnySuffix) {
+            s_values_.AddAnySuffix();
+        } else {
+            s_values_.AddSuffix(values[i], depth, hashes.empty() ? 0 : hashes[i]);
+        }
+    }
+
+    void BuildDenseLevels(std::vector<Level>& levels, size_t dense_levels,
+                          const std::vector<std::string>& values, const std::vector<uint64_t>& hashes) {
+        BitVectorBuilder d_labels;
+        BitVectorBuilder d_has_child;
+        for (size_t idx = 0; idx < dense_levels; ++idx) {
+            Level& level = levels[idx];
+            for (const auto i : level.suffixes) {
+                AddSuffix(values, hashes, i, idx);
+            }
+            BitVector has_child = level.has_child.Build();
+            BitVector louds = level.louds.Build();
+            for (size_t node_start = 0; node_start < level.labels.size();) {
+                bool labels[kDenseFanout] = {};
+                bool node_has_child[kDenseFanout] = {};
+                size_t i = node_start;
+                do {
+                    unsigned char label = level.labels[i];
+                    labels[label] = true;
+                    node_has_child[label] = has_child[i];
+                    ++i;
+                } while (i < level.labels.size() && !louds[i]);
+                for (int j = 0; j < kDenseFanout; ++j) {
+                    d_labels.PushBack(labels[j]);
+                    d_has_child.PushBack(node_has_child[j]);
+                }
+                node_start = i;
+            }
+            level = Level();
+        }
+        d_labels_ = d_labels.Build();
+        d_has_child_ = d_has_child.Build();
+        dense_size_ = d_labels_.Size();
+        dense_nodes_count_ = dense_size_ / kDenseFanout;
+        dense_has_child_count_ = d_has_child_.Rank(dense_size_ - 1);
+        dense_leaves_count_ = d_labels_.Rank(dense_size_ - 1) - dense_has_child_count_;
+    }
+
+    // Labels [begin, end) of the node-th node of a level
+    static void NodeBounds(const BitVector& louds, size_t node, size_t& begin, size_t& end) {
+        begin = louds.Select(node + 1);
+        int next = louds.Select(node + 2);
+        end = next == -1 ? louds.Size() : next;
+    }
+
+    // Nodes below the first sparse level with one label that has a child. Such a node is merged
+    // into the label of its parent, label is set to the position of its label in the level
+    static bool IsPathNode(const std::vector<BitVector>& has_child, const std::vector<BitVector>& louds,
+                           size_t dense_levels, size_t idx, size_t node, size_t& label) {
+        if (idx <= dense_levels || idx >= louds.size()) {
+            return false;
+        }
+        size_t end = 0;
+        NodeBounds(louds[idx], node, label, end);
+        return end - label == 1 && has_child[idx][label];
+    }
+
+    // Path compression takes a has_path bit per remaining label with a child and the end of every path,
+    // and saves the has_child, louds and has_path bits of every merged node. It is used if it costs
+    // less than a bit per merged node, as every merged node also saves a Rank and a Select to queries passing it
+    bool PathsPayOff(const std::vector<Level>& levels, const std::vector<BitVector>& has_child,
+                        const std::vector<BitVector>& louds, size_t dense_levels) const {
+        size_t inner_labels = 0;
+        for (size_t idx = dense_levels; idx < levels.size(); ++idx) {
+            inner_labels += has_child[idx].Rank(has_child[idx].Size() - 1);
+        }
+        size_t merged = 0;
+        size_t paths = 0;
+        for (size_t idx = dense_levels + 1; idx < levels.size(); ++idx) {
+            for (size_t node = 0; node < levels[idx].nodes_count; ++node) {
+                size_t label = 0;
+                if (!IsPathNode(has_child, louds, dense_levels, idx, node, label)) {
+                    continue;
+                }
+                ++merged;
+                size_t parent_label = has_child[idx - 1].Select(node + 1);
+                size_t parent = louds[idx - 1].Rank(parent_label) - 1;
+                paths += !IsPathNode(has_child, louds, dense_levels, idx - 1, parent, label);
+            }
+        }
+        // Bits of a BitVector take about 8/7 bits with the rank directory
+        const double kBitVectorBits = 8.0 / 7.0;
+        double end_bits = std::ceil(std::log2(merged + 1));
+        double extra_bits = kBitVectorBits * (static_cast<double>(inner_labels) - 3.0 * merged) + paths * end_bits;
+        return merged > 0 && extra_bits < merged;
+    }
+
+    // Chains of nodes with one label are merged into the path of the label above them if it saves space,
+    // then the sparse nodes are laid out in BFS order of the merged trie
+    void BuildSparseLevels(std::vector<Level>& levels, size_t dense_levels,
+                           const std::vector<std::string>& values, const std::vector<uint64_t>& hashes) {
+        size_t labels_count = 0;
+        std::vector<BitVector> has_child(levels.size());
+        std::vector<BitVector> louds(levels.size());
+        for (size_t idx = dense_levels; idx < levels.size(); ++idx) {
+            labels_count += levels[idx].labels.size();
+            has_child[idx] = levels[idx].has_child.Build();
+            louds[idx] = levels[idx].louds.Build();
+        }
+        bool compress = PathsPayOff(levels, has_child, louds, dense_levels);
+
+        s_labels_.clear();
+        s_labels_.reserve(labels_count);
+        s_path_labels_.clear();
+        BitVectorBuilder s_has_child;
+        BitVectorBuilder s_louds;
+        BitVectorBuilder s_has_path;
+        std::vector<uint32_t> path_ends;
+        s_has_child.Reserve(labels_count);
+        s_louds.Reserve(labels_count);
+        auto push = [&](size_t idx, size_t i, bool node_start) {
+            s_labels_.push_back(levels[idx].labels[i]);
+            s_has_child.PushBack(has_child[idx][i]);
+            s_louds.PushBack(node_start);
+            if (compress && has_child[idx][i]) {
+                s_has_path.PushBack(false);
+            }
+            if (!has_child[idx][i]) {
+                AddSuffix(values, hashes, levels[idx].suffixes[i - has_child[idx].Rank(i)], idx);
+            }
+        };
+
+        if (!compress) {
+            for (size_t idx = dense_levels; idx < levels.size(); ++idx) {
+                for (size_t i = 0; i < levels[idx].labels.size(); ++i) {
+                    push(idx, i, louds[idx][i]);
+                }
+            }
+        } else if (dense_levels < levels.size()) {
+            // Nodes as (level, index in the level), node k of the level is the child of its k-th label with a child
+            std::vector<std::pair<size_t, size_t>> queue;
+            for (size_t node = 0; node < levels[dense_levels].nodes_count; ++node) {
+                queue.emplace_back(dense_levels, node);
+            }
+            for (size_t head = 0; head < queue.size(); ++head) {
+                auto [idx, node] = queue[head];
+                size_t begin = 0, end = 0;
+                NodeBounds(louds[idx], node, begin, end);
+                for (size_t i = begin; i < end; ++i) {
+                    push(idx, i, i == begin);
+                    if (!has_child[idx][i]) {
+                        continue;
+                    }
+                    size_t child_idx = idx + 1;
+                    size_t child = has_child[idx].Rank(i) - 1;
+                    size_t path_start = s_path_labels_.size();
+                    size_t label = 0;
+                    while (IsPathNode(has_child, louds, dense_levels, child_idx, child, label)) {
+                        s_path_labels_.push_back(levels[child_idx].labels[label]);
+                        child = has_child[child_idx].Rank(label) - 1;
+                        ++child_idx;
+                    }
+                    if (s_path_labels_.size() > path_start) {
+                        s_has_path.SetBack(true);
+                        path_ends.push_back(s_path_labels_.size());
+                    }
+                    queue.emplace_back(child_idx, child);
+                }
+            }
+        }
+        for (size_t idx = dense_levels; idx < levels.size(); ++idx) {
+            levels[idx] = Level();
+        }
+        s_has_child_ = s_has_child.Build();
+        s_louds_ = s_louds.Build();
+        s_has_path_ = s_has_path.Build();
+        s_path_ends_ = CompressedVector<uint32_t>(path_ends.size(), std::max<size_t>(std::ceil(std::log2(s_path_labels_.size() + 1)), 1));
+        s_path_ends_.Set(0, path_ends.data(), path_ends.size());
+
+        s_label_codes_ = CompressedVector<uint32_t>();
+        if (!alphabet_.empty()) {
+            s_label_codes_ = CompressedVector<uint32_t>(s_labels_.size(), label_bits_);
+            const size_t kChunk = 64;
+            uint32_t codes[kChunk];
+            for (size_t i = 0; i < s_labels_.size(); i += kChunk) {
+                size_t count = std::min(kChunk, s_labels_.size() - i);
+                for (size_t j = 0; j < count; ++j) {
+                    codes[j] = symbol_codes_[static_cast<unsigned char>(s_labels_[i + j])];
+                }
+                s_label_codes_.Set(i, codes, count);
+            }
+            s_labels_ = std::vector<char>();
+        }
+    }
+
+    // With reduced labels the sparse labels are stored as codes of ceil(log2(alphabet size)) bits.
+    // The alphabet is sorted as unsigned chars, so codes keep the order of labels. Path labels stay bytes
+    void BuildAlphabet(const std::vector<Level>& levels) {
+        alphabet_.clear();
+        symbol_codes_.clear();
+        if (!reduce_labels_) {
+            return;
+        }
+        bool seen[kDenseFanout] = {};
+        for (const auto& level : levels) {
+            for (const auto c : level.labels) {
+                seen[static_cast<unsigned char>(c)] = true;
+            }
+        }
+        symbol_codes_.resize(kDenseFanout);
+        for (int c = 0; c < kDenseFanout; ++c) {
+            // Code of the first symbol not less than c
+            symbol_codes_[c] = alphabet_.size();
+            if (seen[c]) {
+                alphabet_.push_back(static_cast<char>(c));
+            }
+        }
+        label_bits_ = alphabet_.size() > 1 ? std::ceil(std::log2(alphabet_.size())) : 1;
+        if (label_bits_ >= CHAR_BIT) {
+            alphabet_.clear();
+            symbol_codes_.clear();
+        }
+    }
+
+    bool HasChild(int pos) const {
+        if (pos < dense_size_) {
+            return d_has_child_[pos];
+        }
+        return s_has_child_[pos - dense_size_];
+    }
+
+    // Labels of the nodes merged into the label, empty if there are none
+    std::string_view GetPath(int pos) const {
+        if (pos < dense_size_ || s_has_path_.Size() == 0 || !s_has_child_[pos - dense_size_]) {
+            return std::string_view();
+        }
+        int inner = s_has_child_.Rank(pos - dense_size_) - 1;
+        if (!s_has_path_[inner]) {
+            return std::string_view();
+        }
+        size_t path = s_has_path_.Rank(inner) - 1;
+        size_t begin = path == 0 ? 0 : s_path_ends_.GetValueByIndex(path - 1);
+        return std::string_view(s_path_labels_.data() + begin, s_path_ends_.GetValueByIndex(path) - begin);
+    }
+
+    // 0 if key continues with the path from pos, otherwise the sign of path - key[pos:].
+    // A key ending inside the path is less than it
+    static int ComparePath(std::string_view path, std::string_view key, size_t pos) {
+        size_t length = std::min(path.size(), key.size() - pos);
+        if (length == 0) {
+            return path.empty() ? 0 : 1;
+        }
+        int cmp = std::memcmp(path.data(), key.data() + pos, length);
+        if (cmp != 0) {
+            return cmp;
+        }
+        return length < path.size() ? 1 : 0;
+    }
+
+    char GetLabel(int pos) const {
+        if (pos < dense_size_) {
+            return static_cast<char>(pos % kDenseFanout);
+        }
+        if (!alphabet_.empty()) {
+            return alphabet_[s_label_codes_.GetValueByIndex(pos - dense_size_)];
+        }
+        return s_labels_[pos - dense_size_];
+    }
+
+    // Index of the leaf in s_values_
+    size_t LeafIndex(int pos) const {
+        if (pos < dense_size_) {
+            return d_labels_.Rank(pos) - d_has_child_.Rank(pos) - 1;
+        }
+        pos -= dense_size_;
+        return dense_leaves_count_ + pos - s_has_child_.Rank(pos);
+    }
+
+    // Position of the first label of the node
+    int NodeStart(int node) const {
+        if (node < dense_nodes_count_) {
+            int pos = d_labels_.Select(d_labels_.Rank(node * kDenseFanout - 1) + 1);
+            return pos / kDenseFanout == node ? pos : -1;
+        }
+        return dense_size_ + s_louds_.Select(node - dense_nodes_count_ + 1);
+    }
+
     int MoveToChildren(int parent) const {
         if (parent == -1) {
-            return 0;
+            return dense_nodes_count_ > 0 ? NodeStart(0) : dense_size_;
         }
-        if (s_has_child_[parent] == 0) {
+        if (!HasChild(parent)) {
             return -1;
         }
-        return s_louds_.Select(s_has_child_.Rank(parent) + 1);
+        if (parent < dense_size_) {
+            return NodeStart(d_has_child_.Rank(parent));
+        }
+        return NodeStart(dense_has_child_count_ + s_has_child_.Rank(parent - dense_size_));
     }
 
-    int MoveToParent(int child) const {
-        int r = s_louds_.Rank(child);
-        if (r == 1) {
-            return -1;
+    int NextSibling(int pos) const {
+        if (pos < dense_size_) {
+            int next = d_labels_.Select(d_labels_.Rank(pos) + 1);
+            return next != -1 && next / kDenseFanout == pos / kDenseFanout ? next : -1;
         }
-        return s_has_child_.Select(r - 1);
+        size_t i = pos - dense_size_;
+        return i + 1 < s_louds_.Size() && !s_louds_[i + 1] ? pos + 1 : -1;
+    }
+
+    int PrevSibling(int pos) const {
+        if (pos < dense_size_) {
+            int prev = d_labels_.Select(d_labels_.Rank(pos) - 1);
+            return prev != -1 && prev / kDenseFanout == pos / kDenseFanout ? prev : -1;
+        }
+        size_t i = pos - dense_size_;
+        return !s_louds_[i] ? pos - 1 : -1;
+    }
+
+    int MoveToLastChild(int parent) const {
+        int node = parent < dense_size_ ? d_has_child_.Rank(parent)
+                                        : dense_has_child_count_ + s_has_child_.Rank(parent - dense_size_);
+        if (node < dense_nodes_count_) {
+            return d_labels_.Select(d_labels_.Rank((node + 1) * kDenseFanout - 1));
+        }
+        int next_node = s_louds_.Select(node - dense_nodes_count_ + 2);
+        return dense_size_ + (next_node == -1 ? static_cast<int>(s_louds_.Size()) : next_node) - 1;
     }
 
     int FindChild(int start, char c, bool lower_bound = false) const {
-        for (size_t i = start; i < s_labels_.size(); ++i) {
+        if (start < dense_size_) {
+            int node_start = start - start % kDenseFanout;
+            int pos = node_start + static_cast<unsigned char>(c);
+            if (d_labels_[pos]) {
+                return pos;
+            }
+            if (!lower_bound) {
+                return -1;
+            }
+            // Labels are ordered as unsigned chars, so the next label of the node is the lower bound
+            int next = d_labels_.Select(d_labels_.Rank(pos) + 1);
+            return next != -1 && next / kDenseFanout == pos / kDenseFanout ? next : -1;
+        }
+        start -= dense_size_;
+        if (!alphabet_.empty()) {
+            return FindChildCode(start, c, lower_bound);
+        }
+        size_t i = start;
+#ifdef __SSE2__
+        // Labels of a node are sorted as unsigned chars, so the first label not less than c
+        // is both the exact match and the lower bound. The node ends at the next louds bit.
+        const __m128i target = _mm_set1_epi8(c);
+        for (; i + kLabelsChunk <= s_labels_.size(); i += kLabelsChunk) {
+            uint32_t node_end = s_louds_.GetBits(i, kLabelsChunk);
+            if (i == static_cast<size_t>(start)) {
+                node_end &= ~static_cast<uint32_t>(1);
+            }
+            uint32_t in_node = node_end == 0 ? kLabelsChunkMask : (node_end & -node_end) - 1;
+            __m128i labels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s_labels_.data() + i));
+            __m128i not_less = _mm_cmpeq_epi8(_mm_max_epu8(labels, target), labels);
+            uint32_t found = _mm_movemask_epi8(not_less) & in_node;
+            if (found != 0) {
+                size_t pos = i + __builtin_ctz(found);
+                return lower_bound || s_labels_[pos] == c ? dense_size_ + pos : -1;
+            }
+            if (node_end != 0) {
+                return -1;
+            }
+        }
+#endif
+        for (; i < s_labels_.size(); ++i) {
             if (i > start && s_louds_[i]) {
                 return -1;
             }
             if (s_labels_[i] == c || (lower_bound && (
                     (c < 0 && s_labels_[i] < 0 && c < s_labels_[i]) || (c >= 0 && (s_labels_[i] < 0 || c < s_labels_[i]))
                 ))) {
-                return i;
+                return dense_size_ + i;
             }
         }
         return -1;
     }
 
-    int Go(int start, char c, bool lower_bound = false) const {
-        int children_start = MoveToChildren(start);
-        if (children_start == -1) {
-            return -1;
+    // FindChild on the label codes: the code of the first symbol not less than c is both
+    // the exact match (if c is in the alphabet) and the lower bound
+    int FindChildCode(size_t start, char c, bool lower_bound) const {
+        uint32_t code = symbol_codes_[static_cast<unsigned char>(c)];
+        bool exact = code < alphabet_.size() && alphabet_[code] == c;
+        for (size_t i = start; i < s_louds_.Size() && (i == start || !s_louds_[i]); ++i) {
+            uint32_t label = s_label_codes_.GetValueByIndex(i);
+            if (label >= code) {
+                return lower_bound || (exact && label == code) ? dense_size_ + static_cast<int>(i) : -1;
+            }
         }
-        return FindChild(children_start, c, lower_bound);
+        return -1;
     }
 
-    int MoveToNext(int pos, bool shift_done = false) const {
-        while (pos != -1) {
-            if (shift_done || (pos + 1 < s_louds_.Size() && !s_louds_[pos + 1])) {
-                if (!shift_done) {
-                    pos = pos + 1;
-                }
-                while (s_has_child_[pos]) {
-                    pos = MoveToChildren(pos);
+    // Leaves among the labels before a position
+    size_t LeavesBefore(int pos) const {
+        if (pos <= dense_size_) {
+            return d_labels_.Rank(pos - 1) - d_has_child_.Rank(pos - 1);
+        }
+        pos -= dense_size_;
+        return dense_leaves_count_ + pos - s_has_child_.Rank(pos - 1);
+    }
+
+    // Labels with a child before a position
+    size_t ChildrenBefore(int pos) const {
+        if (pos <= dense_size_) {
+            return d_has_child_.Rank(pos - 1);
+        }
+        return dense_has_child_count_ + s_has_child_.Rank(pos - dense_size_ - 1);
+    }
+
+    // Position of the first label of the node, the end of the trie if there is no such node
+    int NodeBound(size_t node) const {
+        if (node < static_cast<size_t>(dense_nodes_count_)) {
+            return node * kDenseFanout;
+        }
+        int pos = s_louds_.Select(node - dense_nodes_count_ + 1);
+        return dense_size_ + (pos == -1 ? static_cast<int>(s_louds_.Size()) : pos);
+    }
+
+    // Position after the last label of the node starting at start
+    int NodeEnd(int start) const {
+        if (start < dense_size_) {
+            return (start / kDenseFanout + 1) * kDenseFanout;
+        }
+        int next = s_louds_.Select(s_louds_.Rank(start - dense_size_) + 1);
+        return dense_size_ + (next == -1 ? static_cast<int>(s_louds_.Size()) : next);
+    }
+
+    // Level by level positions of a bound: labels before it are the labels of keys less than the key,
+    // or not greater than the key for the upper bound. Leaves matching the key are compared by the real suffix
+    class BoundCuts {
+    public:
+        BoundCuts(const FastSuccinctTrie* trie, std::string_view key, bool upper)
+            : trie_(trie), key_(key), upper_(upper), depth_(0), children_(trie->MoveToChildren(-1)), cut_(0) {
+        }
+
+        bool Walking() const {
+            return children_ != -1;
+        }
+
+        // Position of the bound in the next level
+        int Next() {
+            if (children_ == -1) {
+                cut_ = trie_->NodeBound(trie_->ChildrenBefore(cut_) + 1);
+                return cut_;
+            }
+            int start = children_;
+            children_ = -1;
+            if (depth_ >= key_.size()) {
+                // Keys under the node are longer than the key, except the one ending with the terminator
+                bool terminator = trie_->use_terminator_ && trie_->GetLabel(start) == kTerminator && !trie_->HasChild(start);
+                cut_ = start + (upper_ && terminator);
+                return cut_;
+            }
+            char c = key_[depth_];
+            int pos = trie_->FindChild(start, c, true);
+            if (pos == -1) {
+                cut_ = trie_->NodeEnd(start);
+            } else if (trie_->GetLabel(pos) != c) {
+                cut_ = pos;
+            } else if (!trie_->HasChild(pos)) {
+                size_t leaf = trie_->LeafIndex(pos);
+                int cmp = trie_->s_values_.IsAny(leaf) ? 0 : trie_->s_values_.CompareRealSuffix(key_, depth_, leaf);
+                cut_ = pos + (upper_ ? cmp >= 0 : cmp > 0);
+            } else {
+                std::string_view label_path = trie_->GetPath(pos);
+                int cmp = ComparePath(label_path, key_, depth_ + 1);
+                cut_ = pos + (cmp < 0);
+                if (cmp == 0) {
+                    depth_ += 1 + label_path.size();
+                    children_ = trie_->MoveToChildren(pos);
                 }
-                return pos;
             }
-            pos = MoveToParent(pos);
+            return cut_;
         }
-        return -1;
-    }
 
-    std::string RestoreString(int pos) const {
-        if (pos == -1) {
-            return "";
+    private:
+        const FastSuccinctTrie* trie_;
+        std::string_view key_;
+        bool upper_;
+        size_t depth_;
+        // Start of the node where the walk goes on, -1 after the walk
+        int children_;
+        int cut_;
+    };
+
+    // Compares a restored key with a string char by char, following Iterator::Key rules
+    class RestoredKeyComparator {
+    public:
+        RestoredKeyComparator(std::string_view other, int fixed_length, bool use_any)
+            : other_(other), fixed_length_(fixed_length), use_any_(use_any), length_(0), result_(0) {
         }
 
-        std::string result;
-        if (!s_has_child_[pos] && suffix_type_ == SuffixType::Real) {
-            auto suf = s_values_.GetSuffix(pos - s_has_child_.Rank(pos));
-            if ((suf != kTerminator || !use_terminator_) && (suf != s_values_.GetAny() || !use_any_)) {
-                result += suf;
+        bool Decided() const {
+            return result_ != 0;
+        }
+
+        void Push(char c) {
+            if (result_ != 0 || (fixed_length_ != -1 && length_ >= static_cast<size_t>(fixed_length_))) {
+                return;
+            }
+            if (length_ == other_.size()) {
+                result_ = 1;
+                return;
+            }
+            unsigned char x = c;
+            unsigned char y = other_[length_];
+            if (x != y) {
+                result_ = x < y ? -1 : 1;
             }
+            ++length_;
         }
-        while (pos != -1) {
-            auto suf = s_labels_[pos];
-            if (suf != kTerminator || !use_terminator_) {
-                result += suf;
+
+        bool NotGreater() {
+            if (fixed_length_ != -1 && !use_any_) {
+                while (result_ == 0 && length_ < static_cast<size_t>(fixed_length_)) {
+                    Push(kTerminator);
+                }
             }
-            pos = MoveToParent(pos);
+            return result_ <= 0;
         }
 
-        std::reverse(result.begin(), result.end());
-        if (fixed_length_ != -1) {
-            if (!use_any_ || (result.size() > fixed_length_)) {
-                result.resize(fixed_length_);
+    private:
+        std::string_view other_;
+        int fixed_length_;
+        bool use_any_;
+        size_t length_;
+        int result_;
+    };
+
+    // Restored key is left[0, prefix_length), then the label of pos and, if descend is set,
+    // the labels down to the first leaf under pos, then the real suffix of the leaf
+    bool RestoredNotGreater(std::string_view left, size_t prefix_length, int pos, bool descend, std::string_view right) const {
+        RestoredKeyComparator comparator(right, fixed_length_, use_any_);
+        auto push_label = [&](char label) {
+            if (label != kTerminator || !use_terminator_) {
+                comparator.Push(label);
             }
+        };
+        for (size_t i = 0; i < prefix_length && !comparator.Decided(); ++i) {
+            push_label(left[i]);
         }
-        return result;
+        auto push_labels = [&](int pos) {
+            push_label(GetLabel(pos));
+            for (const auto label : GetPath(pos)) {
+                push_label(label);
+            }
+        };
+        if (descend) {
+            push_labels(pos);
+            while (HasChild(pos) && !comparator.Decided()) {
+                pos = MoveToChildren(pos);
+                push_labels(pos);
+            }
+        }
+        if (!comparator.Decided() && !HasChild(pos)) {
+            size_t index = LeafIndex(pos);
+            size_t length = s_values_.RealSuffixLength(index);
+            for (size_t j = 0; j < length && !comparator.Decided(); ++j) {
+                comparator.Push(s_values_.GetRealSuffixByte(index, j));
+            }
+        }
+        return comparator.NotGreater();
     }
 
+    int Go(int start, char c, bool lower_bound = false) const {
+        int children_start = MoveToChildren(start);
+        if (children_start == -1) {
+            return -1;
+        }
+        return FindChild(children_start, c, lower_bound);
+    }
+
+    BitVector d_labels_;
+    BitVector d_has_child_;
+    int dense_nodes_count_ = 0;
+    int dense_size_ = 0;
+    int dense_has_child_count_ = 0;
+    int dense_leaves_count_ = 0;
+    size_t sparse_dense_ratio_ = kSurfSparseDenseRatio;
+
     std::vector<char> s_labels_;
     BitVector s_has_child_;
     BitVector s_louds_;
+    // Path compression: bit k is set if the k-th sparse label with a child has a path,
+    // the path labels of all of them and the end of every path
+    BitVector s_has_path_;
+    std::vector<char> s_path_labels_;
+    CompressedVector<uint32_t> s_path_ends_;
     SuffixVector s_values_;
     SuffixType suffix_type_;
-    size_t suffix_size_;
+    size_t real_suffix_size_;
+    size_t hash_suffix_size_;
     bool use_terminator_;
     int fixed_length_;
     bool use_any_;
+    // Reduced labels: symbols used by the labels in order, the code of the first symbol not less than a byte,
+    // and the sparse labels as codes. Empty if labels are stored as bytes
+    bool reduce_labels_ = false;
+    std::vector<char> alphabet_;
+    std::vector<uint16_t> symbol_codes_;
+    size_t label_bits_ = CHAR_BIT;
+    CompressedVector<uint32_t> s_label_codes_;
 };
 
-template <class T>
-class DefaultSurfConverter {
-public:
-    std::string ToString(const T& x) const = 0;
-};
+// Converters map keys to strings with the same order.
+// ToString is used to build the trie. Encode is used by queries: it writes the key to buffer
+// of kMaxSize bytes (if the key isn't a string already) and returns a view of it, so queries don't allocate.
+template <class T, class Enable = void>
+class DefaultSurfConverter;
 
 template<>
 class DefaultSurfConverter<std::string> {
 public:
+    static const size_t kMaxSize = 0;
+
     std::string ToString(const std::string& s) const {
         return s;
     }
 
+    std::string_view Encode(const std::string& s, char* /*buffer*/) const {
+        return s;
+    }
+
     std::string FromString(const std::string& s) const {
         return s;
     }
 };
 
+// Big-endian with the sign bit flipped
+template <class T>
+class DefaultSurfConverter<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+public:
+    static const size_t kMaxSize = sizeof(T);
+
+    std::string ToString(T x) const {
+        char buffer[kMaxSize];
+        return std::string(Encode(x, buffer));
+    }
+
+    std::string_view Encode(T x, char* buffer) const {
+        typename std::make_unsigned<T>::type bits = x;
+        if (std::is_signed<T>::value) {
+            bits ^= static_cast<decltype(bits)>(1) << (sizeof(T) * CHAR_BIT - 1);
+        }
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            buffer[i] = static_cast<char>(bits >> ((sizeof(T) - 1 - i) * CHAR_BIT));
+        }
+        return std::string_view(buffer, kMaxSize);
+    }
+};
+
+// IEEE bits, big-endian: negative numbers have all bits inverted, others have the sign bit set.
+// -0.0 is stored as 0.0, NaNs are not supported.
 template<>
-class DefaultSurfConverter<int> {
+class DefaultSurfConverter<double> {
 public:
-    std::string ToString(int x) const {
-        std::string result(4, '\0');
-        char* c = (char*)(&x);
-        result[0] = c[3] ^ (1 << 7);
-        result[1] = c[2];
-        result[2] = c[1];
-        result[3] = c[0];
-        return result;
+    static const size_t kMaxSize = sizeof(uint64_t);
+
+    std::string ToString(double x) const {
+        char buffer[kMaxSize];
+        return std::string(Encode(x, buffer));
+    }
+
+    std::string_view Encode(double x, char* buffer) const {
+        if (x == 0.0) {
+            x = 0.0;
+        }
+        uint64_t bits = 0;
+        std::memcpy(&bits, &x, sizeof(bits));
+        const uint64_t kSignBit = static_cast<uint64_t>(1) << (sizeof(uint64_t) * CHAR_BIT - 1);
+        bits = (bits & kSignBit) ? ~bits : bits | kSignBit;
+        return bits_converter_.Encode(bits, buffer);
+    }
+
+private:
+    DefaultSurfConverter<uint64_t> bits_converter_;
+};
+
+// Concatenation of fixed size encodings of the elements
+template <class... Args>
+class DefaultSurfConverter<std::tuple<Args...>> {
+public:
+    static const size_t kMaxSize = (DefaultSurfConverter<Args>::kMaxSize + ...);
+    static_assert(((DefaultSurfConverter<Args>::kMaxSize > 0) && ...), "Tuple elements must have fixed size encodings");
+
+    std::string ToString(const std::tuple<Args...>& x) const {
+        char buffer[kMaxSize];
+        return std::string(Encode(x, buffer));
+    }
+
+    std::string_view Encode(const std::tuple<Args...>& x, char* buffer) const {
+        EncodeElements(x, buffer, std::index_sequence_for<Args...>());
+        return std::string_view(buffer, kMaxSize);
+    }
+
+private:
+    template <size_t... Indices>
+    void EncodeElements(const std::tuple<Args...>& x, char* buffer, std::index_sequence<Indices...>) const {
+        size_t offset = 0;
+        ((offset += DefaultSurfConverter<Args>().Encode(std::get<Indices>(x), buffer + offset).size()), ...);
     }
 };
 
@@ -455,18 +1564,72 @@ public:
     void Init(SuffixType suf_type,
               size_t suffix_size = kDefaultSurfSuffixSize,
               int fix_length = -1,
-              double cut_gain_threshold = 0.0) {
+              double cut_gain_threshold = 0.0,
+              size_t hash_suffix_size = kDefaultSurfSuffixSize,
+              size_t cut_window = kDefaultCutWindow) {
         // fix_length = - 1 to always use kTerminator (must not be set if numeric values are stored)
         // fix_length = 0 to skip kTerminator when all items have the same length
         // fix_length > 0 to cut all strings to fix_length
-        if (suf_type == SuffixType::Real && suffix_size > kMaxRealSuffixSize) {
-            std::cerr << "Warning! 8 is the max suffix size supported for real suffixes. Reset suffix_size to 8\n";
-            suffix_size = kMaxRealSuffixSize;
+        // For suf_type = Mixed suffix_size is the size of the real suffix and hash_suffix_size of the hash one
+        if (suf_type == SuffixType::Hash && suffix_size > kMaxHashSuffixSize) {
+            std::cerr << "Warning! 32 is the max suffix size supported for hash suffixes. Reset suffix_size to 32\n";
+            suffix_size = kMaxHashSuffixSize;
+        }
+        if (suf_type == SuffixType::Mixed && hash_suffix_size > kMaxHashSuffixSize) {
+            std::cerr << "Warning! 32 is the max suffix size supported for hash suffixes. Reset hash_suffix_size to 32\n";
+            hash_suffix_size = kMaxHashSuffixSize;
         }
-        trie_.Init(suf_type, suffix_size);
+        if (suf_type == SuffixType::Real && cut_gain_threshold > 0.0 && suffix_size > CHAR_BIT) {
+            // Cut keys keep one byte after the leaf label
+            std::cerr << "Warning! 8 is the max real suffix size supported with cut_gain_threshold. Reset suffix_size to 8\n";
+            suffix_size = CHAR_BIT;
+        }
+        trie_.Init(suf_type, suffix_size, kSurfSparseDenseRatio, hash_suffix_size);
         suffix_type_ = suf_type;
         fix_length_ = fix_length;
         cut_gain_threshold_ = cut_gain_threshold;
+        cut_window_ = cut_window;
+        bits_per_key_ = 0.0;
+    }
+
+    // Build chooses the suffixes and the branch cutting so that the filter takes about bits_per_key bits per distinct key.
+    // With range_queries suffix bits go to real suffixes, otherwise to hash suffixes.
+    void InitAuto(double bits_per_key, bool range_queries = true, int fix_length = 0) {
+        if (bits_per_key <= 0.0) {
+            throw "bits_per_key must be positive";
+        }
+        Init(SuffixType::Empty, 0, fix_length);
+        bits_per_key_ = bits_per_key;
+        range_queries_ = range_queries;
+    }
+
+    // Threads used by Build to sort the keys and to collect the trie levels, the filter is the same for any number
+    void SetBuildThreads(size_t threads) {
+        build_threads_ = std::max<size_t>(threads, 1);
+    }
+
+    // Keys are compressed by an order-preserving dictionary (see HopeEncoder) built on Build from a sample of keys.
+    // Build skips the compression if it doesn't shorten the sampled keys. Must be called before Build. Iterators return the compressed keys.
+    void EnableCompression(size_t dictionary_size = kDefaultHopeDictionarySize, size_t sample_size = kDefaultHopeSampleSize) {
+        compress_ = true;
+        hope_dictionary_size_ = dictionary_size;
+        hope_sample_size_ = sample_size;
+    }
+
+    // Sparse labels take ceil(log2(alphabet size)) bits instead of a byte, e.g. 5 bits for lowercase text.
+    // Must be called before Build. Lookups in the sparse levels are slower, as labels are not compared by SIMD
+    void EnableReducedLabels() {
+        trie_.SetReducedLabels(true);
+    }
+
+    // False positive rate of a query that reaches a leaf, estimated for the chosen suffixes by Build with InitAuto
+    double ExpectedFalsePositiveRate() const {
+        return expected_fpr_;
+    }
+
+    // The same for a range query, only real suffixes filter it
+    double ExpectedRangeFalsePositiveRate() const {
+        return expected_range_fpr_;
     }
 
     void Build(const std::vector<T>& values) override {
@@ -475,13 +1638,29 @@ public:
         bool use_any = false;
         size_t min_length = 0, max_length = 0;
         for (const auto& x : values) {
-            auto s = converter_.ToString(x);
-            strings.push_back(s);
-            if (strings.back().size() > max_length) {
-                max_length = strings.back().size();
+            strings.push_back(converter_.ToString(x));
+        }
+        compressed_ = false;
+        if (compress_) {
+            hope_.Build(strings, hope_dictionary_size_, hope_sample_size_);
+            compressed_ = hope_.CompressionRatio() < 1.0;
+            if (!compressed_) {
+                std::cerr << "Warning! The dictionary doesn't make the sampled keys shorter, keys are not compressed\n";
+            }
+        }
+        if (compressed_) {
+            std::string encoded;
+            for (auto& s : strings) {
+                hope_.Encode(s, encoded);
+                s.swap(encoded);
+            }
+        }
+        for (size_t i = 0; i < strings.size(); ++i) {
+            if (strings[i].size() > max_length) {
+                max_length = strings[i].size();
             }
-            if (min_length == 0 || strings.back().size() < min_length) {
-                min_length = strings.back().size();
+            if (min_length == 0 || strings[i].size() < min_length) {
+                min_length = strings[i].size();
             }
         }
         int fixed_length = -1;
@@ -496,7 +1675,11 @@ public:
             use_any = true;
         }
 
-        std::sort(strings.begin(), strings.end());
+        if (build_threads_ > 1) {
+            ParallelSort(strings, build_threads_);
+        } else {
+            std::sort(strings.begin(), strings.end());
+        }
         strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
 
         for (size_t i = 0; i < strings.size(); ++i) {
@@ -506,38 +1689,114 @@ public:
             }
         }
 
-        if (cut_gain_threshold_ > 0.0) {
-            if (suffix_type_ == SuffixType::Hash) {
-                std::cerr << "Warning! For suffix_type = 'hash' cut_gain_threshold must be equal to zero. Reset cut_gain_threshold.";
+        if (bits_per_key_ > 0.0) {
+            Tune(strings);
+        } else if (cut_gain_threshold_ > 0.0) {
+            if (suffix_type_ == SuffixType::Hash || suffix_type_ == SuffixType::Mixed) {
+                std::cerr << "Warning! For suffix_type = 'hash' or 'mixed' cut_gain_threshold must be equal to zero. Reset cut_gain_threshold.";
             } else {
-                PreBuildFilter(strings, cut_gain_threshold_);
+                PreBuildFilter(strings, cut_gain_threshold_, cut_window_);
             }
         }
 
-        trie_.Build(strings, used_terminator, fixed_length, use_any);
+        trie_.Build(strings, used_terminator, fixed_length, use_any, build_threads_);
     }
 
     bool Find(const T& value) const override {
-        return trie_.Find(converter_.ToString(value));
+        char buffer[kBufferSize];
+        return trie_.Find(EncodeKey(value, buffer, EncodedStorage(0)));
     }
 
-    bool FindPrefix(const std::string& value) const {
-        return trie_.FindPrefix(value);
+    bool FindPrefix(std::string_view value) const {
+        if (!compressed_) {
+            return trie_.FindPrefix(value);
+        }
+        // Compressed keys with the prefix are between the codes of the prefix and of the first string after them
+        std::string next(value);
+        while (!next.empty() && static_cast<unsigned char>(next.back()) == UCHAR_MAX) {
+            next.pop_back();
+        }
+        if (next.empty()) {
+            return true;
+        }
+        ++next.back();
+        std::string& left = EncodedStorage(0);
+        std::string& right = EncodedStorage(1);
+        hope_.Encode(value, left);
+        hope_.Encode(next, right);
+        return trie_.RangeNonEmpty(left, right);
     }
 
     bool FindRange(const T& left, const T& right) const {
         if (left == right) {
             return Find(left);
         }
-        return trie_.LowerBound(converter_.ToString(left)) <= converter_.ToString(right);
+        char left_buffer[kBufferSize];
+        char right_buffer[kBufferSize];
+        return trie_.RangeNonEmpty(EncodeKey(left, left_buffer, EncodedStorage(0)),
+                                   EncodeKey(right, right_buffer, EncodedStorage(1)));
     }
 
     bool FindRange(const SearchRange<T>& range) const {
         return FindRange(range.left, range.right);
     }
 
+    // Estimated number of distinct stored keys in [left, right], without a scan.
+    // With fix_length > 0 keys with the same first fix_length bytes are counted once
+    size_t ApproxCount(const T& left, const T& right) const {
+        char left_buffer[kBufferSize];
+        char right_buffer[kBufferSize];
+        return trie_.ApproxCount(EncodeKey(left, left_buffer, EncodedStorage(0)),
+                                 EncodeKey(right, right_buffer, EncodedStorage(1)));
+    }
+
+    // Queries in key order resume from the prefix shared with the previous query.
+    // Any order gives the same answers, sorted order is just faster.
+    std::vector<bool> FindBatchSorted(const std::vector<T>& sorted_keys) const {
+        std::vector<bool> result(sorted_keys.size());
+        FastSuccinctTrie::QueryPath path;
+        char buffer[kBufferSize];
+        for (size_t i = 0; i < sorted_keys.size(); ++i) {
+            result[i] = trie_.Find(EncodeKey(sorted_keys[i], buffer, EncodedStorage(0)), &path);
+        }
+        return result;
+    }
+
+    // Ranges sorted by the left bound
+    std::vector<bool> FindRangeBatchSorted(const std::vector<SearchRange<T>>& sorted_ranges) const {
+        std::vector<bool> result(sorted_ranges.size());
+        FastSuccinctTrie::QueryPath find_path;
+        FastSuccinctTrie::QueryPath range_path;
+        char left_buffer[kBufferSize];
+        char right_buffer[kBufferSize];
+        for (size_t i = 0; i < sorted_ranges.size(); ++i) {
+            const auto& range = sorted_ranges[i];
+            auto left = EncodeKey(range.left, left_buffer, EncodedStorage(0));
+            if (range.left == range.right) {
+                result[i] = trie_.Find(left, &find_path);
+            } else {
+                result[i] = trie_.RangeNonEmpty(left, EncodeKey(range.right, right_buffer, EncodedStorage(1)), &range_path);
+            }
+        }
+        return result;
+    }
+
+    // Iterator over the stored keys (as strings produced by the converter) from the first key not less than key
+    FastSuccinctTrie::Iterator Seek(const T& key) const {
+        char buffer[kBufferSize];
+        auto it = trie_.GetIterator();
+        it.Seek(EncodeKey(key, buffer, EncodedStorage(0)));
+        return it;
+    }
+
+    FastSuccinctTrie::Iterator Begin() const {
+        auto it = trie_.GetIterator();
+        it.SeekToFirst();
+        return it;
+    }
+
     bool GetHashTableSizeBits(size_t& size) const override {
-        size = trie_.CalculateSize();
+        size = trie_.CalculateSize() + (compressed_ ? hope_.BitsSize() : 0);
         return true;
     }
 
@@ -546,8 +1805,10 @@ public:
     }
 
 private:
-    void PreBuildFilter(std::vector<std::string>& strings, double threshold) const {
-        if (strings.empty()) {
+    // Cuts groups of at most window neighbouring keys to their common prefix and one more byte
+    // if the trie gets smaller by more than threshold * (keys in the group)^2 nodes
+    void PreBuildFilter(std::vector<std::string>& strings, double threshold, size_t window) const {
+        if (strings.size() < 2) {
             return;
         }
         std::vector<int> common_prefixes(strings.size());
@@ -578,7 +1839,7 @@ private:
 
         for (size_t i = 0; i < strings.size(); ++i) {
             size_t j = i;
-            while (j < strings.size() - 1 && common_prefixes[j] >= common_prefixes[i] && common_prefixes[j] != 0 && j - i < 20) {
+            while (j < strings.size() - 1 && common_prefixes[j] >= common_prefixes[i] && common_prefixes[j] != 0 && j - i < window) {
                 ++j;
                 int cp = i == 0 ? 0 : common_prefixes[i - 1];
                 int64_t len = j - i + 1;
@@ -587,7 +1848,7 @@ private:
                 size_t size_after_resize = std::max(cp, common_prefixes[j]) + 2;
                 if (cf > threshold) {
                     if (strings[i].size() >= size_after_resize && strings[j].size() >= size_after_resize &&
-                        strings[i].substr(0, size_after_resize) == strings[j].substr(0, size_after_resize)) {
+                        strings[i].compare(0, size_after_resize, strings[j], 0, size_after_resize) == 0) {
                         for (size_t k = i; k <= j; ++k) {
                             strings[k].resize(std::max(cp, common_prefixes[j]) + 2);
                         }
@@ -598,9 +1859,146 @@ private:
         strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
     }
 
+    // Leaf level of every key: the keys are sorted and none is a prefix of another,
+    // so the key ends one label below its longest common prefix with a neighbour
+    static std::vector<size_t> LeafLevels(const std::vector<std::string>& strings, size_t& labels_count) {
+        std::vector<size_t> leaf_levels(strings.size());
+        labels_count = 0;
+        size_t prev = 0;
+        for (size_t i = 0; i < strings.size(); ++i) {
+            size_t next = i + 1 < strings.size() ? CommonPrefixLength(strings[i], strings[i + 1]) : 0;
+            leaf_levels[i] = std::min(std::max(prev, next), std::max<size_t>(strings[i].size(), 1) - 1);
+            labels_count += leaf_levels[i] + 1 - prev;
+            prev = next;
+        }
+        return leaf_levels;
+    }
+
+    // Size of the trie without suffixes. Dense levels are at most 1 / kSurfSparseDenseRatio of the sparse ones
+    // and replace larger sparse levels, so all labels are counted as sparse: a byte and a bit in two BitVectors
+    // which keep a header word per kLineWords = 7 data words
+    static double EstimateTrieBits(size_t labels_count) {
+        return labels_count * (CHAR_BIT + 2.0 * 8 / 7);
+    }
+
+    // Chooses the branch cutting and the suffixes for the bits_per_key_ budget from the key statistics:
+    // the trie size follows from the LCPs of neighbouring keys. Hash bits don't filter range queries,
+    // so with range_queries_ the rest of the budget goes to real suffixes, otherwise to hash suffixes
+    void Tune(std::vector<std::string>& strings) {
+        const double kCutThresholds[] = {0.5, 0.2, 0.1, 0.05, 0.02, 0.01, 0.005};
+        size_t keys_count = std::max<size_t>(strings.size(), 1);
+        double budget = bits_per_key_ * keys_count;
+        size_t labels_count = 0;
+        std::vector<size_t> leaf_levels = LeafLevels(strings, labels_count);
+        double trie_bits = EstimateTrieBits(labels_count);
+        cut_gain_threshold_ = 0.0;
+        // Less and less selective cutting until the trie fits, cut keys keep one byte for the suffix
+        for (size_t t = 0; trie_bits > budget && t < sizeof(kCutThresholds) / sizeof(kCutThresholds[0]); ++t) {
+            std::vector<std::string> cut = strings;
+            PreBuildFilter(cut, kCutThresholds[t], cut_window_);
+            std::vector<size_t> cut_leaf_levels = LeafLevels(cut, labels_count);
+            trie_bits = EstimateTrieBits(labels_count);
+            cut_gain_threshold_ = kCutThresholds[t];
+            strings.swap(cut);
+            leaf_levels.swap(cut_leaf_levels);
+        }
+        if (trie_bits > budget) {
+            std::cerr << "Warning! Even with branch cutting the trie takes " << trie_bits / keys_count
+                      << " bits per key, more than the budget of " << bits_per_key_ << ", no suffixes are stored\n";
+        }
+        size_t suffix_bits = trie_bits < budget && !strings.empty() ? (budget - trie_bits) / strings.size() : 0;
+
+        // collisions[r] is the probability that two leaves have equal first r real suffix bits
+        size_t max_real_bits = std::min(suffix_bits, cut_gain_threshold_ > 0.0 ? CHAR_BIT : kMaxAutoRealSuffixSize);
+        std::vector<double> collisions = RealSuffixCollisions(strings, leaf_levels, max_real_bits);
+        size_t real_bits = cut_gain_threshold_ > 0.0 || range_queries_ ? max_real_bits : 0;
+        size_t hash_bits = cut_gain_threshold_ > 0.0 || range_queries_ ? 0 : std::min(suffix_bits, kMaxHashSuffixSize);
+
+        SuffixType type = SuffixType::Empty;
+        if (real_bits > 0 && hash_bits > 0) {
+            type = SuffixType::Mixed;
+        } else if (real_bits > 0) {
+            type = SuffixType::Real;
+        } else if (hash_bits > 0) {
+            type = SuffixType::Hash;
+        }
+        suffix_type_ = type;
+        trie_.Init(type, type == SuffixType::Hash ? hash_bits : real_bits, kSurfSparseDenseRatio, hash_bits);
+        expected_fpr_ = collisions[real_bits] * std::pow(2.0, -static_cast<double>(hash_bits));
+        expected_range_fpr_ = collisions[real_bits];
+        std::cerr << "SuRF auto: " << real_bits << " real and " << hash_bits << " hash suffix bits, cut_gain_threshold "
+                  << cut_gain_threshold_ << ", about " << (trie_bits + (real_bits + hash_bits) * strings.size()) / keys_count
+                  << " bits per key, expected false positive rate " << expected_fpr_ << " for points and "
+                  << expected_range_fpr_ << " for ranges\n";
+    }
+
+    // Probabilities that two random leaves have equal first r bits of real suffixes, for r in [0, max_bits]
+    static std::vector<double> RealSuffixCollisions(const std::vector<std::string>& strings,
+                                                    const std::vector<size_t>& leaf_levels, size_t max_bits) {
+        std::vector<uint64_t> suffixes(strings.size());
+        for (size_t i = 0; i < strings.size(); ++i) {
+            uint64_t value = 0;
+            for (size_t j = 0; j < sizeof(uint64_t); ++j) {
+                size_t pos = leaf_levels[i] + 1 + j;
+                value = (value << CHAR_BIT) | static_cast<unsigned char>(pos < strings[i].size() ? strings[i][pos] : kTerminator);
+            }
+            suffixes[i] = value;
+        }
+        std::sort(suffixes.begin(), suffixes.end());
+        std::vector<double> collisions(max_bits + 1, 1.0);
+        double pairs = static_cast<double>(suffixes.size()) * suffixes.size();
+        for (size_t r = 1; r <= max_bits && pairs > 0; ++r) {
+            double equal_pairs = 0;
+            for (size_t i = 0; i < suffixes.size();) {
+                size_t j = i;
+                while (j < suffixes.size() && (suffixes[j] >> (64 - r)) == (suffixes[i] >> (64 - r))) {
+                    ++j;
+                }
+                equal_pairs += static_cast<double>(j - i) * (j - i);
+                i = j;
+            }
+            collisions[r] = equal_pairs / pairs;
+        }
+        return collisions;
+    }
+
+    // Storage of compressed query keys, reused by the queries of a thread so that they don't allocate
+    static std::string& EncodedStorage(size_t i) {
+        static thread_local std::string storage[2];
+        return storage[i];
+    }
+
+    // The converter output, compressed into storage if compression is enabled
+    std::string_view EncodeKey(const T& key, char* buffer, std::string& storage) const {
+        auto s = converter_.Encode(key, buffer);
+        if (!compressed_) {
+            return s;
+        }
+        hope_.Encode(s, storage);
+        return storage;
+    }
+
+    // Stack buffer for encoded query keys, one byte more so that it is never empty
+    static const size_t kBufferSize = Converter::kMaxSize + 1;
+    // Real suffix bits considered by Tune, they are taken from the first 8 bytes after the leaf
+    static const size_t kMaxAutoRealSuffixSize = 64;
+
     FastSuccinctTrie trie_;
     Converter converter_;
     SuffixType suffix_type_;
     int fix_length_;
     double cut_gain_threshold_;
+    size_t cut_window_ = kDefaultCutWindow;
+    // Budget of InitAuto, 0 if the parameters are given by Init
+    double bits_per_key_ = 0.0;
+    bool range_queries_ = true;
+    double expected_fpr_ = 1.0;
+    double expected_range_fpr_ = 1.0;
+    size_t build_threads_ = 1;
+    bool compress_ = false;
+    // Keys of the current build are compressed: compression is enabled and pays off
+    bool compressed_ = false;
+    HopeEncoder hope_;
+    size_t hope_dictionary_size_ = kDefaultHopeDictionarySize;
+    size_t hope_sample_size_ = kDefaultHopeSampleSize;
 };
@@ -1,9 +1,16 @@
 #include <climits>
+#include <cmath>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <numeric>
 #include <random>
+#include <tuple>
 
 #include "consts.h"
+#include "elias_fano.h"
+#include "grafite_filter.h"
+#include "rosetta.h"
 #include "surf.h"
 #include "testdata.h"
 
@@ -11,6 +18,11 @@ SuffixType s_type = SuffixType::Hash;
 size_t suffix_size = kDefaultSurfSuffixSize;
 int fixed_length = 0;
 double cut_gain_threshold = 0.0;
+size_t hash_suffix_size = kDefaultSurfSuffixSize;
+
+// Ranges of the large int test span 3 gaps between 60000 uniform numbers, about 215000
+const uint64_t kLargeIntMaxRangeLength = 1 << 18;
+const size_t kParallelBuildThreads = 4;
 
 template <class T, class Function>
 void TestQueries(const std::vector<T>& queries, std::vector<T>& found, std::vector<T>& not_found, Function f) {
@@ -47,7 +59,7 @@ void PrintTestResult(const std::string& label, const std::vector<T>& found, cons
 template <class T>
 void RunExactQueriesTest(const std::vector<T>& a, const std::vector<T>& b) {
     auto ptr = std::make_unique<SuccinctRangeFilter<T>>();
-    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     ptr->Build(a);
 
     std::vector<T> found;
@@ -63,7 +75,7 @@ void RunRangeQueriesTest(const std::vector<std::string>& a,
                           const std::vector<SearchRange<std::string>>& true_range,
                           const std::vector<SearchRange<std::string>>& false_range) {
     auto ptr = std::make_unique<SuccinctRangeFilter<std::string>>();
-    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     ptr->Build(a);
 
     std::vector<SearchRange<std::string>> found;
@@ -77,7 +89,7 @@ void RunRangeQueriesTest(const std::vector<std::string>& a,
 
 void RunPrefixQueriesTest(const std::vector<std::string>& a, const std::vector<std::string>& b) {
     auto ptr = std::make_unique<SuccinctRangeFilter<std::string>>();
-    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     ptr->Build(a);
 
     std::vector<std::string> prefix;
@@ -114,7 +126,7 @@ void RunSmallTests() {
         "ccaa",
     });
     SuccinctRangeFilter<std::string> first_filter;
-    first_filter.Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    first_filter.Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     first_filter.Build(first);
     RunExactQueriesTest(first, std::vector<std::string>());
     /*
@@ -177,7 +189,7 @@ void RunLargeTextTest() {
 
     std::cerr << "Build filter for " << strings_to_add.size() << " words of " << n << "\n\n";
     auto ptr = std::make_unique<SuccinctRangeFilter<std::string>>();
-    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     ptr->Build(strings_to_add);
 
     std::cerr << "Checking existing values\n";
@@ -276,7 +288,7 @@ void RunLargeIntTest() {
 
     std::cerr << "Build filter for " << values_to_add.size() << " numbers of " << n << "\n\n";
     auto ptr = std::make_unique<SuccinctRangeFilter<int>>();
-    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold);
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
     ptr->Build(values_to_add);
 
     std::cerr << "Checking existing values\n";
@@ -334,6 +346,431 @@ void RunLargeIntTest() {
     std::cerr << "Found (false positive) " << found_fp << " of " << mbf << " (" << percent_found << "%)\n\n\n";
 }
 
+// Data of the large tests shared by the runs below: sorted distinct values, about a quarter of them
+// is added to the filters (with some of their prefixes for strings)
+template <class T>
+struct LargeTestData {
+    std::vector<T> values;
+    std::vector<bool> in;
+    std::vector<T> values_to_add;
+    std::vector<T> missing_values;
+    std::vector<T> prefixes;
+};
+
+// The strings of RunLargeTextTest
+LargeTestData<std::string> GenerateLargeText() {
+    std::mt19937 generator(322);
+    RandomTextTestData<std::mt19937> g(generator, 1, 15);
+    std::uniform_int_distribution<int> distribution(0, 3);
+
+    LargeTestData<std::string> data;
+    size_t n = 30000;
+    for (size_t i = 0; i < n; ++i) {
+        data.values.push_back(g.AddQuery());
+    }
+    std::sort(data.values.begin(), data.values.end());
+    data.values.erase(std::unique(data.values.begin(), data.values.end()), data.values.end());
+
+    for (const auto& s : data.values) {
+        data.in.push_back(distribution(generator) == 0);
+        if (data.in.back()) {
+            data.values_to_add.push_back(s);
+            for (size_t j = 0; j < s.size(); ++j) {
+                if (distribution(generator) == 0) {
+                    data.prefixes.push_back(s.substr(0, j + 1));
+                }
+            }
+        } else {
+            data.missing_values.push_back(s);
+        }
+    }
+    std::sort(data.prefixes.begin(), data.prefixes.end());
+    data.prefixes.erase(std::unique(data.prefixes.begin(), data.prefixes.end()), data.prefixes.end());
+    return data;
+}
+
+// The numbers of RunLargeIntTest
+LargeTestData<int> GenerateLargeInts() {
+    std::mt19937 generator(44);
+    UniformIntTestData<std::mt19937> g(generator, std::numeric_limits<int>::min(), std::numeric_limits<int>::max());
+    std::uniform_int_distribution<int> distribution(0, 3);
+
+    LargeTestData<int> data;
+    size_t n = 60000;
+    for (size_t i = 0; i < n; ++i) {
+        data.values.push_back(g.AddQuery());
+    }
+    std::sort(data.values.begin(), data.values.end());
+    data.values.erase(std::unique(data.values.begin(), data.values.end()), data.values.end());
+
+    for (int x : data.values) {
+        data.in.push_back(distribution(generator) == 0);
+        if (data.in.back()) {
+            data.values_to_add.push_back(x);
+        } else {
+            data.missing_values.push_back(x);
+        }
+    }
+    return data;
+}
+
+template <class T, class Function>
+void CheckFound(const std::string& label, const std::vector<T>& queries, Function find) {
+    std::cerr << label << "\n";
+    int found = 0;
+    for (const auto& x : queries) {
+        if (find(x)) {
+            ++found;
+        }
+    }
+    double percent_found = 100 * static_cast<double>(found) / queries.size();
+    std::cerr << "Found " << found << " of " << queries.size() << " (" << percent_found << "%)\n\n";
+}
+
+// Throws unless check(i) holds for all i in [0, count)
+template <class Function>
+void CheckAll(const std::string& label, size_t count, Function check) {
+    std::cerr << label << "\n";
+    for (size_t i = 0; i < count; ++i) {
+        if (!check(i)) {
+            std::cerr << "Mismatch at " << i << "\n";
+            throw "Check failed";
+        }
+    }
+    std::cerr << "OK for " << count << " queries\n\n";
+}
+
+// Ranges of 4 neighbouring values, the ones with an added value must be found
+template <class T, class Function>
+void CheckRanges(const LargeTestData<T>& data, Function find_range) {
+    std::cerr << "Checking ranges\n";
+    int found = 0;
+    int found_fp = 0;
+    int mbt = 0;
+    int mbf = 0;
+    for (size_t i = 0; i + 3 < data.values.size(); ++i) {
+        bool must_be_true = false;
+        for (size_t j = i; j <= i + 3; ++j) {
+            if (data.in[j]) {
+                must_be_true = true;
+            }
+        }
+
+        if (must_be_true) {
+            ++mbt;
+        } else {
+            ++mbf;
+        }
+
+        if (find_range(data.values[i], data.values[i + 3])) {
+            if (must_be_true) {
+                ++found;
+            } else {
+                ++found_fp;
+            }
+        } else if (must_be_true) {
+            std::cerr << "BAD: " << data.values[i] << " -- " << data.values[i + 3] << "\n";
+        }
+    }
+    double percent_found = 100 * static_cast<double>(found) / (mbt);
+    std::cerr << "Found (true positive) " << found << " of " << mbt << " (" << percent_found << "%)\n";
+    percent_found = 100 * static_cast<double>(found_fp) / (mbf);
+    std::cerr << "Found (false positive) " << found_fp << " of " << mbf << " (" << percent_found << "%)\n\n\n";
+}
+
+template <class T>
+std::unique_ptr<SuccinctRangeFilter<T>> BuildSurf(const std::vector<T>& values_to_add) {
+    auto ptr = std::make_unique<SuccinctRangeFilter<T>>();
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
+    ptr->Build(values_to_add);
+    return ptr;
+}
+
+// Keys restored by the iterator are cut to the stored prefix and real suffix bits: the i-th of them is not greater
+// than the i-th added string and greater than the previous one. Seek, Next and Prev must step through them in order.
+void RunIteratorTest(const LargeTestData<std::string>& text) {
+    std::cerr << "Iterator test\n";
+    const auto& keys = text.values_to_add;
+    auto check = [](bool condition, const std::string& message) {
+        if (!condition) {
+            std::cerr << message << "\n";
+            throw "Iterator test failed";
+        }
+    };
+    // Without fixed length and branch cutting every added string keeps its own leaf
+    auto ptr = std::make_unique<SuccinctRangeFilter<std::string>>();
+    ptr->Init(s_type, suffix_size, 0, 0.0, hash_suffix_size);
+    ptr->Build(keys);
+
+    std::vector<std::string> restored;
+    for (auto it = ptr->Begin(); it.Valid(); it.Next()) {
+        restored.push_back(it.Key());
+    }
+    check(restored.size() == keys.size(), "Next walked " + std::to_string(restored.size()) + " keys");
+    for (size_t i = 0; i < keys.size(); ++i) {
+        check(restored[i] <= keys[i] && (i == 0 || keys[i - 1] < restored[i]), "Key " + restored[i] + " is out of order");
+    }
+
+    auto it = ptr->Seek(keys.back());
+    for (size_t i = keys.size(); i-- > 0; it.Prev()) {
+        check(it.Valid() && it.Key() == restored[i], "Prev missed key " + restored[i]);
+    }
+    check(!it.Valid(), "Prev went before the first key");
+    it = ptr->Begin();
+    it.Prev();
+    check(!it.Valid(), "Prev went before the first key");
+    check(ptr->Seek("").Valid() && ptr->Seek("").Key() == restored[0], "Seek of the empty string missed the first key");
+    // Text strings consist of lowercase letters, so "{" is greater than all of them
+    check(!ptr->Seek("{").Valid(), "Seek went past the last key");
+
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto next = ptr->Seek(keys[i]);
+        check(next.Valid() && next.Key() == restored[i], "Seek missed key " + keys[i]);
+        auto prev = next;
+        next.Next();
+        prev.Prev();
+        check(next.Valid() ? i + 1 < keys.size() && next.Key() == restored[i + 1] : i + 1 == keys.size(),
+              "Next after Seek missed the key after " + keys[i]);
+        check(prev.Valid() ? i > 0 && prev.Key() == restored[i - 1] : i == 0, "Prev after Seek missed the key before " + keys[i]);
+    }
+    // A missing string is either after the stored part of the previous key or matches it
+    for (const auto& x : text.missing_values) {
+        size_t j = std::lower_bound(keys.begin(), keys.end(), x) - keys.begin();
+        auto found = ptr->Seek(x);
+        bool next_key = found.Valid() && j < keys.size() && found.Key() == restored[j];
+        bool previous_key = found.Valid() && j > 0 && found.Key() == restored[j - 1];
+        check(found.Valid() ? next_key || previous_key : j == keys.size(), "Seek landed far from " + x);
+    }
+    std::cerr << "Walked " << restored.size() << " keys with Next and Prev, sought " << keys.size() << " added and "
+              << text.missing_values.size() << " missing strings\n\n";
+}
+
+// Sorted batches must give the same answers as single queries, for all values and ranges of 4 neighbouring values
+template <class T>
+void CheckBatches(const LargeTestData<T>& data) {
+    auto ptr = BuildSurf(data.values_to_add);
+
+    std::vector<SearchRange<T>> ranges;
+    for (size_t i = 0; i + 3 < data.values.size(); ++i) {
+        ranges.emplace_back(data.values[i], data.values[i + 3]);
+    }
+    std::vector<bool> found = ptr->FindBatchSorted(data.values);
+    std::vector<bool> found_ranges = ptr->FindRangeBatchSorted(ranges);
+
+    CheckAll("Checking sorted batch of values against Find", data.values.size(), [&](size_t i) {
+        return found[i] == ptr->Find(data.values[i]);
+    });
+    CheckAll("Checking sorted batch of ranges against FindRange", ranges.size(), [&](size_t i) {
+        return found_ranges[i] == ptr->FindRange(ranges[i]);
+    });
+}
+
+void RunBatchTest(const LargeTestData<std::string>& text, const LargeTestData<int>& ints) {
+    std::cerr << "Batch test\n";
+    CheckBatches(text);
+    CheckBatches(ints);
+}
+
+// The filter built by several threads must be the same as the single thread one
+template <class T>
+void CheckParallelBuild(const LargeTestData<T>& data) {
+    auto single = BuildSurf(data.values_to_add);
+    auto parallel = std::make_unique<SuccinctRangeFilter<T>>();
+    parallel->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
+    parallel->SetBuildThreads(kParallelBuildThreads);
+    parallel->Build(data.values_to_add);
+
+    size_t single_size = 0;
+    size_t parallel_size = 0;
+    single->GetHashTableSizeBits(single_size);
+    parallel->GetHashTableSizeBits(parallel_size);
+    std::cerr << "Filter size (bits): " << single_size << " in one thread, " << parallel_size << " in "
+              << kParallelBuildThreads << " threads\n\n";
+    if (single_size != parallel_size) {
+        throw "Parallel build changed the filter size";
+    }
+    CheckAll("Checking values against the single thread build", data.values.size(), [&](size_t i) {
+        return parallel->Find(data.values[i]) == single->Find(data.values[i]);
+    });
+    CheckAll("Checking ranges against the single thread build", data.values.size() - 3, [&](size_t i) {
+        const T& l = data.values[i];
+        const T& r = data.values[i + 3];
+        return parallel->FindRange(l, r) == single->FindRange(l, r);
+    });
+}
+
+void RunParallelBuildTest(const LargeTestData<std::string>& text, const LargeTestData<int>& ints) {
+    std::cerr << "Parallel build test\n";
+    CheckParallelBuild(text);
+    CheckParallelBuild(ints);
+}
+
+// Large text test for a filter with an option turned on before Build
+template <class Function>
+void RunLargeTextOptionTest(const std::string& label, const LargeTestData<std::string>& text, Function turn_on) {
+    std::cerr << label << "\n";
+    auto ptr = std::make_unique<SuccinctRangeFilter<std::string>>();
+    ptr->Init(s_type, suffix_size, fixed_length, cut_gain_threshold, hash_suffix_size);
+    turn_on(*ptr);
+    ptr->Build(text.values_to_add);
+    size_t size = 0;
+    ptr->GetHashTableSizeBits(size);
+    std::cerr << "Filter size (bits): " << size << "\n\n";
+
+    CheckFound("Checking existing values", text.values_to_add, [&](const std::string& x) {return ptr->Find(x);});
+    CheckFound("Checking missing values", text.missing_values, [&](const std::string& x) {return ptr->Find(x);});
+    CheckFound("Checking prefixes", text.prefixes, [&](const std::string& x) {return ptr->FindPrefix(x);});
+    CheckRanges(text, [&](const std::string& l, const std::string& r) {return ptr->FindRange(l, r);});
+}
+
+// ApproxCount of ranges of length neighbouring values against the number of added values in them.
+// Only the leaves matching a bound may be miscounted, so the estimate exceeds the count by at most 2.
+// It is less by at most 2 too when every added value has its own leaf (no fixed length and branch cutting).
+template <class T>
+void CheckApproxCount(const LargeTestData<T>& data, size_t length) {
+    auto ptr = BuildSurf(data.values_to_add);
+
+    std::vector<size_t> added(data.values.size() + 1, 0);
+    for (size_t i = 0; i < data.values.size(); ++i) {
+        added[i + 1] = added[i] + data.in[i];
+    }
+    bool own_leaves = fixed_length <= 0 && cut_gain_threshold == 0.0;
+    size_t ranges = 0;
+    size_t exact = 0;
+    double error = 0.0;
+    for (size_t i = 0; i + length <= data.values.size(); ++i) {
+        size_t count = added[i + length] - added[i];
+        size_t estimate = ptr->ApproxCount(data.values[i], data.values[i + length - 1]);
+        ++ranges;
+        exact += estimate == count;
+        if (estimate > count + 2 || (own_leaves && estimate + 2 < count)) {
+            std::cerr << "ApproxCount " << estimate << " for a range of " << count << " values\n";
+            throw "ApproxCount error is too large";
+        }
+        error += std::abs(static_cast<double>(estimate) - static_cast<double>(count));
+    }
+    std::cerr << "ApproxCount of ranges of " << length << " values: exact " << exact << " of " << ranges << " ("
+              << 100 * static_cast<double>(exact) / ranges << "%), mean absolute error " << error / ranges << "\n\n";
+}
+
+void RunApproxCountTest(const LargeTestData<std::string>& text, const LargeTestData<int>& ints) {
+    std::cerr << "Approximate count test\n";
+    CheckApproxCount(text, 4);
+    CheckApproxCount(text, 100);
+    CheckApproxCount(ints, 4);
+    CheckApproxCount(ints, 100);
+}
+
+// Elias-Fano sequence of the added numbers and the Grafite filter on it
+void RunGrafiteTest(const LargeTestData<int>& ints) {
+    std::cerr << "Grafite test\n";
+    auto to_unsigned = [](int x) {return static_cast<uint64_t>(static_cast<uint32_t>(x) ^ (1u << 31));};
+    std::vector<uint64_t> sequence;
+    for (const auto& x : ints.values_to_add) {
+        sequence.push_back(to_unsigned(x));
+    }
+    EliasFano elias_fano;
+    elias_fano.Build(sequence, static_cast<uint64_t>(1) << 32);
+    std::cerr << "Elias-Fano bits per value: " << static_cast<double>(elias_fano.BitsSize()) / sequence.size() << "\n";
+    std::vector<size_t> indices(sequence.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    CheckFound("Checking Elias-Fano values", indices, [&](size_t i) {return elias_fano.Get(i) == sequence[i];});
+    CheckFound("Checking Elias-Fano successors of all numbers", ints.values, [&](int x) {
+        uint64_t result = 0;
+        auto it = std::lower_bound(sequence.begin(), sequence.end(), to_unsigned(x));
+        bool found = elias_fano.Successor(to_unsigned(x), result);
+        return found == (it != sequence.end()) && (!found || result == *it);
+    });
+
+    std::mt19937 generator(44);
+    for (double false_positive_rate : {0.1, 0.01}) {
+        GrafiteFilter<int> filter;
+        filter.Init(generator, kLargeIntMaxRangeLength, false_positive_rate);
+        filter.Build(ints.values_to_add);
+        size_t size = 0;
+        filter.GetHashTableSizeBits(size);
+        std::cerr << "Grafite filter, false positive rate " << false_positive_rate << ", bits per number: "
+                  << static_cast<double>(size) / ints.values_to_add.size() << "\n\n";
+        CheckFound("Checking existing values", ints.values_to_add, [&](int x) {return filter.Find(x);});
+        CheckRanges(ints, [&](int l, int r) {return filter.FindRange(l, r);});
+    }
+}
+
+void RunRosettaTest(const LargeTestData<int>& ints) {
+    std::cerr << "Rosetta test\n";
+    std::mt19937 generator(44);
+    for (double bits_per_key : {16.0, 24.0}) {
+        RosettaFilter<int> filter;
+        filter.Init(generator, kLargeIntMaxRangeLength, bits_per_key);
+        filter.Build(ints.values_to_add);
+        size_t size = 0;
+        filter.GetHashTableSizeBits(size);
+        std::cerr << "Rosetta filter, bits per number: " << static_cast<double>(size) / ints.values_to_add.size() << "\n\n";
+        CheckFound("Checking existing values", ints.values_to_add, [&](int x) {return filter.Find(x);});
+        CheckFound("Checking missing values", ints.missing_values, [&](int x) {return filter.Find(x);});
+        CheckRanges(ints, [&](int l, int r) {return filter.FindRange(l, r);});
+    }
+}
+
+// Encodings of values sorted by operator< must be sorted as strings, equal values must have equal encodings
+template <class T>
+void CheckConverterOrder(const std::string& label, std::vector<T> values) {
+    std::sort(values.begin(), values.end());
+    DefaultSurfConverter<T> converter;
+    for (size_t i = 1; i < values.size(); ++i) {
+        std::string previous = converter.ToString(values[i - 1]);
+        std::string current = converter.ToString(values[i]);
+        if (values[i - 1] < values[i] ? !(previous < current) : previous != current) {
+            std::cerr << label << ": encodings of values " << i - 1 << " and " << i << " are out of order\n";
+            throw "Converter test failed";
+        }
+    }
+    std::cerr << label << ": " << values.size() << " values OK\n";
+}
+
+void RunConverterTest() {
+    std::cerr << "Converter test\n";
+    std::mt19937 generator(40);
+    std::vector<int64_t> signed_values = {std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::min() + 1,
+                                          -256, -255, -1, 0, 1, 255, 256, std::numeric_limits<int64_t>::max()};
+    std::vector<uint64_t> unsigned_values = {0, 1, static_cast<uint64_t>(std::numeric_limits<int64_t>::max()),
+                                             static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) + 1,
+                                             std::numeric_limits<uint64_t>::max()};
+    std::vector<double> double_values = {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::max(),
+                                         -1.5, -1.0, -std::numeric_limits<double>::denorm_min(), -0.0, 0.0,
+                                         std::numeric_limits<double>::denorm_min(), 1.0, 1.5,
+                                         std::numeric_limits<double>::max(), std::numeric_limits<double>::infinity()};
+    std::vector<std::tuple<int, double, uint64_t>> tuple_values;
+    std::uniform_int_distribution<int64_t> signed_distribution(std::numeric_limits<int64_t>::min());
+    std::uniform_int_distribution<uint64_t> unsigned_distribution;
+    std::normal_distribution<double> double_distribution(0.0, 1000.0);
+    std::uniform_int_distribution<int> small_distribution(-2, 2);
+    for (size_t i = 0; i < 1000; ++i) {
+        signed_values.push_back(signed_distribution(generator));
+        unsigned_values.push_back(unsigned_distribution(generator));
+        double_values.push_back(double_distribution(generator));
+        // Few distinct first fields, so that later fields decide the order
+        tuple_values.emplace_back(small_distribution(generator), small_distribution(generator) * 0.5,
+                                  unsigned_distribution(generator) >> (small_distribution(generator) + 2));
+    }
+    tuple_values.emplace_back(-1, -0.0, 0);
+    tuple_values.emplace_back(-1, 0.0, 0);
+    CheckConverterOrder("int64_t", signed_values);
+    CheckConverterOrder("uint64_t", unsigned_values);
+    CheckConverterOrder("double", double_values);
+    CheckConverterOrder("tuple<int, double, uint64_t>", tuple_values);
+
+    // Ranges around zero must be found in a filter of negative and positive numbers
+    std::vector<int64_t> keys = {-1000, -3, 5, 1000};
+    SuccinctRangeFilter<int64_t> filter;
+    filter.Init(s_type, suffix_size, 0, 0.0, hash_suffix_size);
+    filter.Build(keys);
+    if (!filter.FindRange(-4, -2) || !filter.FindRange(-2, 5) || !filter.FindRange(-1001, -999) || !filter.FindRange(999, 1001)) {
+        throw "Converter test failed";
+    }
+    std::cerr << "OK\n\n";
+}
+
 int main(int argc, char** argv) {
     if (argc < 2) {
         std::cerr << "Usage: ./surf type [suffix_size]\n";
@@ -345,6 +782,8 @@ int main(int argc, char** argv) {
         s_type = SuffixType::Empty;
     } else if (type == "real") {
         s_type = SuffixType::Real;
+    } else if (type == "mixed") {
+        s_type = SuffixType::Mixed;
     }
 
     if (argc > 2) {
@@ -356,8 +795,27 @@ int main(int argc, char** argv) {
     if (argc > 4) {
         cut_gain_threshold = std::stod(argv[4]);
     }
+    if (argc > 5) {
+        hash_suffix_size = std::stoi(argv[5]);
+    }
 
     RunSmallTests();
     RunLargeTextTest();
     RunLargeIntTest();
+
+    LargeTestData<std::string> text = GenerateLargeText();
+    LargeTestData<int> ints = GenerateLargeInts();
+    RunIteratorTest(text);
+    RunBatchTest(text, ints);
+    RunParallelBuildTest(text, ints);
+    RunLargeTextOptionTest("Large text test with key compression", text, [](SuccinctRangeFilter<std::string>& filter) {
+        filter.EnableCompression();
+    });
+    RunLargeTextOptionTest("Large text test with reduced labels", text, [](SuccinctRangeFilter<std::string>& filter) {
+        filter.EnableReducedLabels();
+    });
+    RunApproxCountTest(text, ints);
+    RunGrafiteTest(ints);
+    RunRosettaTest(ints);
+    RunConverterTest();
 }
\ No newline at end of file
@@ -1,11 +1,18 @@
+#pragma once
+
 #include "compressed_vector.h"
+#include "consts.h"
+#include "external_storage.h"
 #include "filter.h"
 #include "hash.h"
 
+#include <algorithm>
 #include <cmath>
+#include <memory>
 #include <queue>
 #include <stack>
-#include <unordered_set>
+#include <type_traits>
+#include <unordered_map>
 
 using HashTableInt = uint32_t;
 
@@ -22,10 +29,75 @@ public:
     }
 
     void Build(const std::vector<T>& values) override {
+        BuildTable(values, [this, &values](size_t index) { return GetFingerPrint(values[index]); });
+    }
+
+    // Builds the filter from a file of distinct keys without loading them into memory.
+    // Keys are streamed once per attempt into (slot, key record) pairs sorted on disk by slot. Peeling goes in rounds
+    // over the sorted pairs, merged with the sorted pairs removed by the previous round, and the peeling order
+    // is spilled to a temporary file. Only run_records pairs are sorted in memory at once, besides the table itself.
+    void BuildFromFile(const std::string& filename, KeyFileFormat format = KeyFileFormat::Lines,
+                       size_t run_records = kDefaultXorFileRunRecords) {
+        static_assert(std::is_same<T, std::string>::value, "Only string keys can be read from a file");
+        KeyFileReader reader(filename, format);
+        size_t keys_count = reader.Count();
+        size_t table_size = std::ceil(buckets_count_coefficient_ * keys_count) + additional_buckets_;
+        hash_table_ = CompressedVector<HashTableInt>(table_size, fingerprint_size_bits_);
+        size_t range = table_size / hash_functions_count_;
+        if (range > std::numeric_limits<uint32_t>::max()) {
+            throw "Too many keys for the file build";
+        }
+
+        SpillStack<PeeledSlot> building_stack;
+        size_t attempt = 0;
+        do {
+            if (attempt++ == kMaxFileBuildAttempts) {
+                throw "Can't build xor filter from file, check that the keys are distinct";
+            }
+            hash_functions_.clear();
+            building_stack.Clear();
+            for (size_t i = 0; i < hash_functions_count_; ++i) {
+                hash_functions_.emplace_back(hash_function_builder_(generator_));
+            }
+        } while (!DoFileMappingStep(reader, run_records, building_stack));
+
+        while (!building_stack.Empty()) {
+            auto peeled = building_stack.Pop();
+            size_t index = range * peeled.function_num + peeled.record.offsets[peeled.function_num];
+
+            hash_table_.SetValueByIndex(index, 0);
+            HashTableInt number_to_store = peeled.record.fingerprint;
+            for (size_t i = 0; i < hash_functions_count_; ++i) {
+                number_to_store ^= hash_table_.GetValueByIndex(range * i + peeled.record.offsets[i]);
+            }
+            hash_table_.SetValueByIndex(index, number_to_store);
+        }
+    }
+
+    bool Find(const T& value) const override {
+        return GetTableValue(value) == GetFingerPrint(value);
+    }
+
+    bool GetHashTableSizeBits(size_t& size) const override {
+        size = hash_table_.BitsSize();
+        return true;
+    }
+
+    bool GetUsedSpaceBits(size_t& size) const override {
+        size = used_buckets_ * fingerprint_size_bits_;
+        return true;
+    }
+
+protected:
+    // Peels the values and stores value_function(i) for each values[i],
+    // so that xor of the three cells of values[i] is equal to value_function(i)
+    template <class ValueFunction>
+    void BuildTable(const std::vector<T>& values, ValueFunction value_function) {
         size_t table_size = std::ceil(buckets_count_coefficient_ * values.size()) + additional_buckets_;
         hash_table_ = CompressedVector<HashTableInt>(table_size, fingerprint_size_bits_);
 
-        std::stack<std::pair<T, size_t>> building_stack;
+        // Pairs of the index in values and the cell to store its value in
+        std::stack<std::pair<size_t, size_t>> building_stack;
         do {
             hash_functions_.clear();
             while (!building_stack.empty()) {
@@ -36,40 +108,29 @@ public:
             for (size_t i = 0; i < hash_functions_count_; ++i) {
                 hash_functions_.emplace_back(hash_function_builder_(generator_));
             }
-        } while (!DoMappingStep(values, building_stack));
+        } while (!DoMappingStep(values, value_function, building_stack));
 
         while (!building_stack.empty()) {
             auto pair = building_stack.top();
             building_stack.pop();
 
             hash_table_.SetValueByIndex(pair.second, 0);
-            HashTableInt number_to_store = GetFingerPrint(pair.first);
+            HashTableInt number_to_store = value_function(pair.first);
             for (size_t i = 0; i < hash_functions_count_; ++i) {
-                number_to_store ^= hash_table_.GetValueByIndex(CountHash(pair.first, i));
+                number_to_store ^= hash_table_.GetValueByIndex(CountHash(values[pair.first], i));
             }
             hash_table_.SetValueByIndex(pair.second, number_to_store);
         }
     }
 
-    bool Find(const T& value) const override {
+    HashTableInt GetTableValue(const T& value) const {
         HashTableInt result = 0;
         for (size_t i = 0; i < hash_functions_count_; ++i) {
             result ^= hash_table_.GetValueByIndex(CountHash(value, i));
         }
-        return result == GetFingerPrint(value);
+        return result;
     }
 
-    bool GetHashTableSizeBits(size_t& size) const override {
-        size = hash_table_.BitsSize();
-        return true;
-    }
-
-    bool GetUsedSpaceBits(size_t& size) const override {
-        size = used_buckets_ * fingerprint_size_bits_;
-        return true;
-    }
-
-private:
     HashTableInt GetFingerPrint(const T& x) const {
         return fingerprint_function_(x) % (1 << fingerprint_size_bits_);
     }
@@ -79,17 +140,23 @@ private:
         return range * function_num + hash_functions_[function_num](value) % range;
     }
 
-    bool DoMappingStep(const std::vector<T>& values, std::stack<std::pair<T, size_t>>& output_stack) {
-        std::vector<std::unordered_set<T>> distribution(hash_table_.Size());
+    // Cells keep their values with the index of the first occurrence of each one.
+    // Repeated values must have equal value_function.
+    template <class ValueFunction>
+    bool DoMappingStep(const std::vector<T>& values, ValueFunction value_function,
+                       std::stack<std::pair<size_t, size_t>>& output_stack) {
+        std::vector<std::unordered_map<T, size_t>> distribution(hash_table_.Size());
         size_t unique_count = 0;
-        for (const auto& x : values) {
+        for (size_t index = 0; index < values.size(); ++index) {
             for (size_t i = 0; i < hash_functions_count_; ++i) {
-                auto hash = CountHash(x, i);
-                if (distribution[hash].find(x) == distribution[hash].end()) {
-                    distribution[hash].insert(x);
-                    if (i == 0) {
-                        ++unique_count;
-                    }
+                auto inserted = distribution[CountHash(values[index], i)].emplace(values[index], index);
+                if (i != 0) {
+                    continue;
+                }
+                if (inserted.second) {
+                    ++unique_count;
+                } else if (value_function(inserted.first->second) != value_function(index)) {
+                    throw "Different values for the same key";
                 }
             }
         }
@@ -109,11 +176,11 @@ private:
             queue.pop();
 
             if (distribution[index].size() == 1) {
-                auto value = *distribution[index].begin();
-                output_stack.push(std::make_pair(value, index));
+                size_t value_index = distribution[index].begin()->second;
+                const T& value = values[value_index];
+                output_stack.push(std::make_pair(value_index, index));
 
                 for (size_t i = 0; i < hash_functions_count_; ++i) {
-                    auto set = distribution[CountHash(value, i)];
                     distribution[CountHash(value, i)].erase(value);
                     if (distribution[CountHash(value, i)].size() == 1) {
                         queue.push(CountHash(value, i));
@@ -125,6 +192,123 @@ private:
         return output_stack.size() == unique_count;
     }
 
+    static const size_t hash_functions_count_ = 3;
+    static const size_t kMaxFileBuildAttempts = 32;
+
+    struct SlotRecord {
+        uint32_t offsets[hash_functions_count_];
+        HashTableInt fingerprint;
+
+        bool operator ==(const SlotRecord& other) const {
+            return std::equal(offsets, offsets + hash_functions_count_, other.offsets) && fingerprint == other.fingerprint;
+        }
+    };
+
+    // A key record in the slot of its function_num-th hash function
+    struct PeeledSlot {
+        SlotRecord record;
+        uint32_t function_num;
+    };
+
+    struct SlotLess {
+        size_t range;
+
+        size_t Slot(const PeeledSlot& x) const {
+            return range * x.function_num + x.record.offsets[x.function_num];
+        }
+
+        bool operator()(const PeeledSlot& a, const PeeledSlot& b) const {
+            return Slot(a) < Slot(b);
+        }
+    };
+
+    using SlotSorter = ExternalSorter<PeeledSlot, SlotLess>;
+
+    // Each round takes the pairs left after the previous one, sorted by slot, and drops the pairs of the keys peeled
+    // by the previous round. A slot left with one pair peels its key, and the other pairs of the key are removed
+    // in the next round. A key may be peeled from two slots in one round, that just assigns it twice.
+    // Peeling succeeds if no pairs are left when a round peels nothing.
+    bool DoFileMappingStep(KeyFileReader& reader, size_t run_records, SpillStack<PeeledSlot>& output_stack) {
+        SlotLess slot_less{hash_table_.Size() / hash_functions_count_};
+        SlotSorter sorted_pairs(slot_less, run_records);
+        reader.Rewind();
+        std::string key;
+        while (reader.Next(key)) {
+            SlotRecord record;
+            for (size_t i = 0; i < hash_functions_count_; ++i) {
+                record.offsets[i] = hash_functions_[i](key) % slot_less.range;
+            }
+            record.fingerprint = GetFingerPrint(key);
+            for (size_t i = 0; i < hash_functions_count_; ++i) {
+                sorted_pairs.Add({record, static_cast<uint32_t>(i)});
+            }
+        }
+        sorted_pairs.Sort();
+
+        used_buckets_ = 0;
+        bool first_round = true;
+        auto pairs = std::make_unique<RecordFile<PeeledSlot>>();
+        auto removed = std::make_unique<SlotSorter>(slot_less, run_records);
+        removed->Sort();
+        std::vector<PeeledSlot> group;
+        while (true) {
+            auto next_pairs = std::make_unique<RecordFile<PeeledSlot>>();
+            auto next_removed = std::make_unique<SlotSorter>(slot_less, run_records);
+            auto next_pair = [&](PeeledSlot& pair) {return first_round ? sorted_pairs.Next(pair) : pairs->Next(pair);};
+            size_t peeled_count = 0;
+
+            PeeledSlot pair;
+            PeeledSlot removal;
+            bool has_pair = next_pair(pair);
+            bool has_removal = removed->Next(removal);
+            while (has_pair) {
+                size_t slot = slot_less.Slot(pair);
+                group.clear();
+                for (; has_pair && slot_less.Slot(pair) == slot; has_pair = next_pair(pair)) {
+                    group.push_back(pair);
+                }
+                if (first_round) {
+                    ++used_buckets_;
+                }
+                // Removals of keys already dropped from the slot are skipped
+                for (; has_removal && slot_less.Slot(removal) <= slot; has_removal = removed->Next(removal)) {
+                    if (slot_less.Slot(removal) != slot) {
+                        continue;
+                    }
+                    auto it = std::find_if(group.begin(), group.end(), [&removal](const PeeledSlot& x) {
+                        return x.record == removal.record;
+                    });
+                    if (it != group.end()) {
+                        *it = group.back();
+                        group.pop_back();
+                    }
+                }
+
+                if (group.size() == 1) {
+                    output_stack.Push(group[0]);
+                    ++peeled_count;
+                    for (uint32_t i = 0; i < hash_functions_count_; ++i) {
+                        if (i != group[0].function_num) {
+                            next_removed->Add({group[0].record, i});
+                        }
+                    }
+                } else {
+                    for (const auto& x : group) {
+                        next_pairs->Push(x);
+                    }
+                }
+            }
+
+            first_round = false;
+            pairs = std::move(next_pairs);
+            removed = std::move(next_removed);
+            removed->Sort();
+            if (peeled_count == 0) {
+                return pairs->Empty();
+            }
+        }
+    }
+
     CompressedVector<HashTableInt> hash_table_;
     std::vector<LinearHashFunction> hash_functions_;
     HashFunctionBuilder hash_function_builder_;
@@ -134,5 +318,35 @@ private:
     double buckets_count_coefficient_;
     size_t additional_buckets_;
     size_t used_buckets_;
-    static const size_t hash_functions_count_ = 3;
+};
+
+// Static retrieval structure: maps every key of the build set to a ValueBits-bit value
+// using the same peeling as XorFilter (3 memory reads per lookup, ~1.23 * ValueBits bits per key).
+// Get for a key outside of the build set returns an arbitrary value.
+template <class T, size_t ValueBits, class HashFunctionBuilder = LinearHashFunctionBuilder>
+class XorRetrieval : private XorFilter<T, HashFunctionBuilder> {
+    using XF = XorFilter<T, HashFunctionBuilder>;
+    static_assert(ValueBits > 0 && ValueBits < sizeof(HashTableInt) * CHAR_BIT, "Unsupported value size");
+public:
+    void Init(double buckets_count_coefficient = kDefaultBucketsCountCoefficient,
+              size_t additional_buckets = kDefaultAdditionalBuckets) {
+        XF::Init(ValueBits, buckets_count_coefficient, additional_buckets);
+    }
+
+    void Build(const std::vector<T>& keys, const std::vector<HashTableInt>& values) {
+        if (keys.size() != values.size()) {
+            throw "Keys and values must have the same size";
+        }
+        XF::BuildTable(keys, [&values](size_t index) { return values[index] & kValueMask; });
+    }
+
+    HashTableInt Get(const T& key) const {
+        return XF::GetTableValue(key);
+    }
+
+    using XF::GetHashTableSizeBits;
+    using XF::GetUsedSpaceBits;
+
+private:
+    static const HashTableInt kValueMask = (static_cast<HashTableInt>(1) << ValueBits) - 1;
 };